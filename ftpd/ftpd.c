@@ -91,6 +91,10 @@
 #ifdef HAVE_MMAP
 # include <sys/mman.h>
 #endif
+#if defined HAVE_SENDFILE && defined HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+# define USE_SENDFILE 1
+#endif
 /* Include glob.h last, because it may define "const" which breaks
    system headers on some platforms. */
 #include <glob.h>
@@ -238,6 +242,8 @@ char proctitle[LINE_MAX];	/* initial part of title */
 extern int yyparse (void);
 
 static void ack (const char *);
+static size_t ascii_from_net (char *, size_t, int *, int *);
+static size_t ascii_to_net (const char *, size_t, char *);
 #ifdef HAVE_LIBWRAP
 static int check_host (struct sockaddr *sa, socklen_t len);
 #endif
@@ -253,6 +259,7 @@ static void myoob (int);
 static int receive_data (FILE *, FILE *, off_t);
 static void send_data (FILE *, FILE *, off_t);
 static void sigquit (int);
+static int write_data (int, const char *, size_t);
 
 const char doc[] =
 #ifdef WITH_PAM
@@ -1309,6 +1316,109 @@ dataconn (const char *name, off_t size, const char *mode)
 }
 
 #define IU_MMAP_SIZE 0x800000	/* 8 MByte */
+#define IU_SENDFILE_SIZE 0x800000	/* Largest single sendfile.  */
+#define IU_ASCII_SIZE 0x10000	/* Text converted at a time.  */
+
+/* Conversion buffer of ASCII transfers.  It is not allocated per
+   transfer, since an ABOR longjmps out of send_data and receive_data.  */
+static char ascii_buf[3 * IU_ASCII_SIZE];
+
+/* Copy the LEN bytes of local text at IN to OUT in network ASCII, with
+   a carriage return before every linefeed.  OUT must have room for
+   twice LEN bytes.  Return the length of the result.  */
+static size_t
+ascii_to_net (const char *in, size_t len, char *out)
+{
+  const char *end = in + len, *nl;
+  char *q = out;
+
+  while ((nl = memchr (in, '\n', end - in)) != NULL)
+    {
+      memcpy (q, in, nl - in);
+      q += nl - in;
+      *q++ = '\r';
+      *q++ = '\n';
+      in = nl + 1;
+    }
+  memcpy (q, in, end - in);
+  return q + (end - in) - out;
+}
+
+/* Convert the LEN bytes of network ASCII read to BUF + 1 into local
+   text at BUF, and return its length.  A carriage return followed by a
+   linefeed becomes a linefeed, and one followed by a null a carriage
+   return.  *CR tells whether the previous buffer ended in a carriage
+   return, which is then written here, and is set if this one does.
+   Linefeeds without a carriage return are counted in *BARE_LFS.  */
+static size_t
+ascii_from_net (char *buf, size_t len, int *cr, int *bare_lfs)
+{
+  char *p = buf + 1, *end = buf + 1 + len, *q = buf, *r, *nl;
+  size_t n;
+
+  if (*cr)
+    {
+      *cr = 0;
+      if (*p == '\n')
+	*q++ = *p++;
+      else
+	{
+	  *q++ = '\r';
+	  if (*p == '\0')
+	    p++;
+	}
+    }
+
+  while (p < end)
+    {
+      r = memchr (p, '\r', end - p);
+      n = (r ? r : end) - p;
+      for (nl = p; (nl = memchr (nl, '\n', p + n - nl)) != NULL; nl++)
+	(*bare_lfs)++;
+      if (q != p)
+	memmove (q, p, n);
+      q += n;
+      p += n;
+      if (!r)
+	break;
+
+      if (++p == end)
+	{
+	  *cr = 1;
+	  break;
+	}
+      if (*p == '\n')
+	*q++ = *p++;
+      else
+	{
+	  *q++ = '\r';
+	  if (*p == '\0')
+	    p++;
+	}
+    }
+  return q - buf;
+}
+
+/* Write all LEN bytes at BUF to FD.  Return 0, or -1 on error.  */
+static int
+write_data (int fd, const char *buf, size_t len)
+{
+  ssize_t cnt;
+
+  while (len > 0)
+    {
+      cnt = write (fd, buf, len);
+      if (cnt < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      buf += cnt;
+      len -= cnt;
+    }
+  return 0;
+}
 
 /* Tranfer the contents of "instr" to "outstr" peer using the appropriate
    encapsulation of the data subject * to Mode, Structure, and Type.
@@ -1317,15 +1427,23 @@ dataconn (const char *name, off_t size, const char *mode)
 static void
 send_data (FILE * instr, FILE * outstr, off_t blksize)
 {
-  int c, cnt, filefd, netfd;
-  char *buf = MAP_FAILED, *bp;
-  off_t curpos;
-  off_t len, filesize;
+  int cnt, filefd, netfd;
+  char *volatile buf = MAP_FAILED;	/* Mapped file.  */
+  char *volatile data = NULL;	/* Buffer of image block mode.  */
+  char *bp;
+  volatile off_t curpos = -1;
+  volatile off_t filesize = 0;
+  off_t len;
 
   transflag++;
   if (setjmp (urgcatch))
     {
       transflag = 0;
+#ifdef HAVE_MMAP
+      if (buf != MAP_FAILED)
+	munmap (buf, filesize);
+#endif
+      free (data);
       return;
     }
 
@@ -1336,7 +1454,12 @@ send_data (FILE * instr, FILE * outstr, off_t blksize)
    * at least for Solaris and Linux, so use mmap()
    * only with null offset retrievals.
    */
-  if (file_size > 0 && file_size < IU_MMAP_SIZE && restart_point == 0)
+  if (file_size > 0 && file_size < IU_MMAP_SIZE && restart_point == 0
+# ifdef USE_SENDFILE
+      /* Images are sent with sendfile.  */
+      && type == TYPE_A
+# endif
+    )
     {
       curpos = lseek (filefd, 0, SEEK_CUR);
       if (debug)
@@ -1359,52 +1482,75 @@ send_data (FILE * instr, FILE * outstr, off_t blksize)
 	{
 	  if (debug)
 	    syslog (LOG_DEBUG, "Reading file as ascii in mmap mode.");
-	  len = 0;
-	  while (len < filesize)
+	  for (len = 0; len < filesize; len += cnt)
 	    {
-	      byte_count++;
-	      if (buf[len] == '\n')
-		{
-		  if (ferror (outstr))
-		    break;
-		  putc ('\r', outstr);
-		}
-	      putc (buf[len], outstr);
-	      len++;
+	      cnt = (filesize - len < IU_ASCII_SIZE
+		     ? filesize - len : IU_ASCII_SIZE);
+	      if (write_data (netfd, ascii_buf,
+			      ascii_to_net (buf + len, cnt, ascii_buf)) < 0)
+		break;
+	      byte_count += cnt;
 	    }
-	  fflush (outstr);
 	  transflag = 0;
 	  munmap (buf, filesize);
-	  if (ferror (outstr))
+	  if (len < filesize)
 	    goto data_err;
 	  reply (226, "Transfer complete.");
 	  return;
 	}
 #endif
       if (debug)
-	syslog (LOG_DEBUG, "Reading file as ascii in byte mode.");
-      while ((c = getc (instr)) != EOF)
+	syslog (LOG_DEBUG, "Reading file as ascii in block mode.");
+      while ((cnt = fread (ascii_buf, 1, IU_ASCII_SIZE, instr)) > 0)
 	{
-	  byte_count++;
-	  if (c == '\n')
-	    {
-	      if (ferror (outstr))
-		goto data_err;
-	      putc ('\r', outstr);
-	    }
-	  putc (c, outstr);
+	  if (write_data (netfd, ascii_buf + IU_ASCII_SIZE,
+			  ascii_to_net (ascii_buf, cnt,
+					ascii_buf + IU_ASCII_SIZE)) < 0)
+	    break;
+	  byte_count += cnt;
 	}
-      fflush (outstr);
       transflag = 0;
       if (ferror (instr))
 	goto file_err;
-      if (ferror (outstr))
+      if (cnt > 0)
 	goto data_err;
       reply (226, "Transfer complete.");
       return;
 
     case TYPE_I:
     case TYPE_L:
+#ifdef USE_SENDFILE
+      /* Let the kernel copy from the current position, wherever a
+         restart left it, straight to the socket.  Input it cannot
+         send this way, such as the pipe of a conversion command,
+         falls back to the loop below.  */
+      if (lseek (filefd, 0, SEEK_CUR) >= 0)
+	{
+	  ssize_t sent;
+
+	  if (debug)
+	    syslog (LOG_DEBUG, "Reading file as image with sendfile.");
+	  do
+	    {
+	      sent = sendfile (netfd, filefd, NULL, IU_SENDFILE_SIZE);
+	      if (sent > 0)
+		byte_count += sent;
+	    }
+	  while (sent > 0 || (sent < 0 && errno == EINTR));
+	  if (sent == 0)
+	    {
+	      transflag = 0;
+	      reply (226, "Transfer complete.");
+	      return;
+	    }
+	  if (errno == EIO)
+	    goto file_err;
+	  if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+	    goto data_err;
+	  if (debug)
+	    syslog (LOG_DEBUG, "sendfile: %m, falling back.");
+	}
+#endif
 #ifdef HAVE_MMAP
       if (file_size > 0 && curpos >= 0 && buf != MAP_FAILED)
 	{
@@ -1439,19 +1585,19 @@ send_data (FILE * instr, FILE * outstr, off_t blksize)
 	    syslog (LOG_DEBUG, "Starting at position %jd.", curpos);
 	}
 
-      buf = malloc ((u_int) blksize);
-      if (buf == NULL)
+      data = malloc ((u_int) blksize);
+      if (data == NULL)
 	{
 	  transflag = 0;
 	  perror_reply (451, "Local resource failure: malloc");
 	  return;
 	}
-      while ((cnt = read (filefd, buf, (u_int) blksize)) > 0 &&
-	     write (netfd, buf, cnt) == cnt)
+      while ((cnt = read (filefd, data, (u_int) blksize)) > 0 &&
+	     write (netfd, data, cnt) == cnt)
 	byte_count += cnt;
 
       transflag = 0;
-      free (buf);
+      free (data);
       if (cnt != 0)
 	{
 	  if (cnt < 0)
@@ -1483,10 +1629,12 @@ file_err:
 static int
 receive_data (FILE * instr, FILE * outstr, off_t blksize)
 {
-  int c;
-  int cnt, bare_lfs = 0;
+  int cnt;
+  static int cr, bare_lfs;	/* Out of reach of longjmp.  */
+  size_t len;
   char *buf;
 
+  cr = bare_lfs = 0;
   transflag++;
   if (setjmp (urgcatch))
     {
@@ -1526,28 +1674,19 @@ receive_data (FILE * instr, FILE * outstr, off_t blksize)
       return -1;
 
     case TYPE_A:
-      while ((c = getc (instr)) != EOF)
+      /* Read one byte in, leaving room for a carriage return from the
+         previous buffer.  */
+      while ((cnt = read (fileno (instr), ascii_buf + 1, IU_ASCII_SIZE)) > 0)
 	{
-	  byte_count++;
-	  if (c == '\n')
-	    bare_lfs++;
-	  while (c == '\r')
-	    {
-	      if (ferror (outstr))
-		goto data_err;
-	      c = getc (instr);
-	      if (c != '\n')
-		{
-		  putc ('\r', outstr);
-		  if (c == '\0' || c == EOF)
-		    goto contin2;
-		}
-	    }
-	  putc (c, outstr);
-	contin2:;
+	  byte_count += cnt;
+	  len = ascii_from_net (ascii_buf, cnt, &cr, &bare_lfs);
+	  if (fwrite (ascii_buf, 1, len, outstr) != len)
+	    break;
 	}
+      if (cnt == 0 && cr)
+	putc ('\r', outstr);
       fflush (outstr);
-      if (ferror (instr))
+      if (cnt < 0)
 	goto data_err;
       if (ferror (outstr))
 	goto file_err;
@@ -109,17 +109,23 @@
 #ifdef HAVE_SYS_RESOURCE_H
 # include <sys/resource.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -130,6 +136,9 @@
 #include <progname.h>
 #include <sys/select.h>
 #include <grp.h>
+#ifdef HAVE_POSIX_SPAWN
+# include <spawn.h>
+#endif
 
 #include "libinetutils.h"
 #include "argcv.h"
@@ -143,15 +152,25 @@
 #define TOOMANY		1000	/* don't start more than TOOMANY */
 #define CNT_INTVL	60	/* servers in CNT_INTVL sec. */
 #define RETRYTIME	(60*10)	/* retry after bind or server fail */
+#define EPOLL_EVENTS	64	/* events taken per wakeup */
+#define PREFORK_IDLE	60	/* stop a spare worker after idling so long */
+#define PREFORK_CHECK	10	/* seconds between checks for spare workers */
 
 #ifndef SIGCHLD
 # define SIGCHLD	SIGCLD
 #endif
-#define SIGBLOCK	(sigmask(SIGCHLD)|sigmask(SIGHUP)|sigmask(SIGALRM))
+#define SIGBLOCK	(sigmask(SIGCHLD)|sigmask(SIGHUP)|sigmask(SIGALRM)\
+			 |sigmask(SIGUSR2))
 
 bool debug = false;
 int nsock, maxsock;
+#ifdef HAVE_SYS_EPOLL_H
+int epfd = -1;			/* polls the sockets of all services */
+# define EDGE_TRIGGERED 1
+#else
 fd_set allsock;
+# define EDGE_TRIGGERED 0
+#endif
 int options;
 int timingout;
 unsigned toomany = TOOMANY;
@@ -164,6 +183,8 @@ static bool env_option = false;	       /* Set environment variables */
 static bool resolve_option = false;    /* Resolve IP addresses */
 static bool pidfile_option = true;     /* Record the PID in a file */
 static const char *pid_file = PATH_INETDPID;
+static const char *stats_file = PATH_INETDSTATS;
+static bool reread_all;		/* Reread unchanged files on SIGHUP.  */
 
 const char args_doc[] = "[CONF-FILE [CONF-DIR]]...";
 const char doc[] = "Internet super-server.";
@@ -171,7 +192,9 @@ const char doc[] = "Internet super-server.";
 /* Define keys for long options that do not have short counterparts. */
 enum {
   OPT_ENVIRON = 256,
-  OPT_RESOLVE
+  OPT_REREAD_ALL,
+  OPT_RESOLVE,
+  OPT_STATS_FILE
 };
 
 const char *program_authors[] = {
@@ -191,9 +214,14 @@ static struct argp_option argp_options[] = {
     GRP+1 },
   {"rate", 'R', "NUMBER", 0,
    "maximum invocation rate (per minute)", GRP+1},
+  {"reread-all", OPT_REREAD_ALL, NULL, 0,
+   "reread all configuration files on SIGHUP, even unchanged ones", GRP+1},
   {"resolve", OPT_RESOLVE, NULL, 0,
    "resolve IP addresses when setting environment variables "
    "(see --environment)", GRP+1},
+  {"stats-file", OPT_STATS_FILE, "FILE", 0,
+   "write statistics to FILE on SIGUSR2 (default: \"" PATH_INETDSTATS "\")",
+   GRP+1},
 #undef GRP
   {NULL, 0, NULL, 0, NULL, 0}
 };
@@ -231,10 +259,18 @@ parse_opt (int key, char *arg,
         toomany = number;
       break;
 
+    case OPT_REREAD_ALL:
+      reread_all = true;
+      break;
+
     case OPT_RESOLVE:
       resolve_option = true;
       break;
 
+    case OPT_STATS_FILE:
+      stats_file = arg;
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -246,10 +282,30 @@ static struct argp argp =
   {argp_options, parse_opt, args_doc, doc, NULL, NULL, NULL};
 
 
+/*
+ * Configuration files read, and whether they changed.  The entries of
+ * a file that is the same as when it was last read are kept as they
+ * are, without reading it again.
+ */
+struct conffile
+{
+  struct conffile *cf_next;
+  char *cf_path;
+  dev_t cf_dev;
+  ino_t cf_ino;
+  off_t cf_size;
+  struct timespec cf_mtime;
+  struct timespec cf_ctime;
+  bool cf_seen;			/* found by this reading */
+  bool cf_same;			/* unchanged since the last one */
+  bool cf_retry;		/* entries were dropped, read it again */
+};
+
 struct servtab
 {
   const char *se_file;
   int se_line;
+  struct conffile *se_cf;	/* file of the entry */
   char *se_node;                /* node name */
   char *se_service;		/* name of service */
   int se_socktype;		/* type of socket to use */
@@ -259,6 +315,10 @@ struct servtab
   short se_checked;		/* looked at during merge */
   char *se_user;		/* user name to run as */
   char *se_group;		/* group name to run as */
+  uid_t se_uid;			/* user ID of se_user */
+  gid_t se_gid;			/* group ID to run as */
+  gid_t *se_groups;		/* supplementary groups of se_user */
+  int se_ngroups;		/* number of the same */
   struct biltin *se_bi;		/* if built-in, description */
   char *se_server;		/* server program */
   char **se_argv;		/* program arguments */
@@ -272,9 +332,32 @@ struct servtab
   unsigned se_refcnt;
   unsigned se_count;			/* number started since se_time */
   struct timeval se_time;	/* start of se_count */
+  unsigned se_pmin;		/* prefork: workers kept running */
+  unsigned se_pmax;		/* prefork: largest number of workers */
+  struct pool *se_pool;		/* prefork: running workers */
+  unsigned se_instances;	/* limit of running children */
+  unsigned se_persource;	/* the same, per client address */
+  bool se_report;		/* log bytes and time of builtins */
+  unsigned se_listeners;	/* sockets sharing the address */
+  unsigned se_listener;		/* which of them this is */
+  unsigned se_backlog;		/* listen backlog, or 0 */
+  unsigned se_deferaccept;	/* TCP_DEFER_ACCEPT seconds, or 0 */
+  unsigned se_fastopen;		/* TCP_FASTOPEN queue length, or 0 */
+  unsigned se_active;		/* running children */
+  unsigned long se_accepted;	/* connections served */
+  unsigned long se_rejected;	/* connections refused over the limits */
+  unsigned long se_exited;	/* children reaped */
+  unsigned long long se_runtime;	/* their total lifetime, in ms */
+  unsigned long se_lastaccepted;	/* se_accepted at se_lasttime */
+  struct timeval se_lasttime;	/* last statistics, or start */
   struct servtab *se_next;
+  struct servtab *se_hnext;	/* next in servhash */
 } *servtab;
 
+/* Services hashed by name and protocol, for merging configurations.  */
+#define SERVHASH 1021
+struct servtab *servhash[SERVHASH];
+
 #define NORM_TYPE	0
 #define MUX_TYPE	1
 #define MUXPLUS_TYPE	2
@@ -296,6 +379,11 @@ void machtime_dg (int, struct servtab *);
 void machtime_stream (int, struct servtab *);
 void tcpmux (int s, struct servtab *sep);
 
+struct conn;
+void chargen_conn (struct conn *);
+void discard_conn (struct conn *);
+void echo_conn (struct conn *);
+
 struct biltin
 {
   const char *bi_service;	/* internally provided service name */
@@ -303,25 +391,26 @@ struct biltin
   short bi_fork;		/* 1 if should fork before call */
   short bi_wait;		/* 1 if should wait for child */
   void (*bi_fn) (int s, struct servtab *);	/*function which performs it */
+  void (*bi_conn) (struct conn *);	/* the same, within inetd */
 } biltins[] =
   {
     /* Echo received data */
-    {"echo", SOCK_STREAM, 1, 0, echo_stream},
-    {"echo", SOCK_DGRAM, 0, 0, echo_dg},
+    {"echo", SOCK_STREAM, 1, 0, echo_stream, echo_conn},
+    {"echo", SOCK_DGRAM, 0, 0, echo_dg, NULL},
     /* Internet /dev/null */
-    {"discard", SOCK_STREAM, 1, 0, discard_stream},
-    {"discard", SOCK_DGRAM, 0, 0, discard_dg},
+    {"discard", SOCK_STREAM, 1, 0, discard_stream, discard_conn},
+    {"discard", SOCK_DGRAM, 0, 0, discard_dg, NULL},
     /* Return 32 bit time since 1900 */
-    {"time", SOCK_STREAM, 0, 0, machtime_stream},
-    {"time", SOCK_DGRAM, 0, 0, machtime_dg},
+    {"time", SOCK_STREAM, 0, 0, machtime_stream, NULL},
+    {"time", SOCK_DGRAM, 0, 0, machtime_dg, NULL},
     /* Return human-readable time */
-    {"daytime", SOCK_STREAM, 0, 0, daytime_stream},
-    {"daytime", SOCK_DGRAM, 0, 0, daytime_dg},
+    {"daytime", SOCK_STREAM, 0, 0, daytime_stream, NULL},
+    {"daytime", SOCK_DGRAM, 0, 0, daytime_dg, NULL},
     /* Familiar character generator */
-    {"chargen", SOCK_STREAM, 1, 0, chargen_stream},
-    {"chargen", SOCK_DGRAM, 0, 0, chargen_dg},
-    {"tcpmux", SOCK_STREAM, 1, 0, tcpmux},
-    {NULL, 0, 0, 0, NULL}
+    {"chargen", SOCK_STREAM, 1, 0, chargen_stream, chargen_conn},
+    {"chargen", SOCK_DGRAM, 0, 0, chargen_dg, NULL},
+    {"tcpmux", SOCK_STREAM, 1, 0, tcpmux, NULL},
+    {NULL, 0, 0, 0, NULL, NULL}
   };
 
 #define NUMINT	(sizeof(intab) / sizeof(struct inent))
@@ -385,6 +474,7 @@ signal_block (SIGSTATUS * old_status)
   sigaddset (&sigs, SIGCHLD);
   sigaddset (&sigs, SIGHUP);
   sigaddset (&sigs, SIGALRM);
+  sigaddset (&sigs, SIGUSR2);
   sigprocmask (SIG_BLOCK, &sigs, old_status);
 #else
   long omask = sigblock (SIGBLOCK);
@@ -410,13 +500,49 @@ signal_unblock (SIGSTATUS * status)
 #endif
 }
 
+/*
+ * Take on the identity given for SEP, and execute its server.
+ * Standard input is set up already.
+ */
 void
-run_service (int ctrl, struct servtab *sep)
+exec_service (struct servtab *sep)
 {
-  struct passwd *pwd;
-  struct group *grp = NULL;
   char buf[50];
 
+  if (sep->se_uid)
+    {
+      if (setgid (sep->se_gid) < 0)
+	{
+	  syslog (LOG_ERR, "%s: can't set gid %d: %m",
+		  sep->se_service, (int) sep->se_gid);
+	  _exit (EXIT_FAILURE);
+	}
+#if defined HAVE_GETGROUPLIST
+      if (setgroups (sep->se_ngroups, sep->se_groups) < 0)
+	{
+	  syslog (LOG_ERR, "%s: can't set groups: %m", sep->se_service);
+	  _exit (EXIT_FAILURE);
+	}
+#elif defined HAVE_INITGROUPS
+      initgroups (sep->se_user, sep->se_gid);
+#endif
+      if (setuid (sep->se_uid) < 0)
+	{
+	  syslog (LOG_ERR, "%s: can't set uid %d: %m",
+		  sep->se_service, (int) sep->se_uid);
+	  _exit (EXIT_FAILURE);
+	}
+    }
+  execv (sep->se_server, sep->se_argv);
+  if (sep->se_socktype != SOCK_STREAM)
+    recv (0, buf, sizeof buf, 0);
+  syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
+  _exit (EXIT_FAILURE);
+}
+
+void
+run_service (int ctrl, struct servtab *sep)
+{
   if (sep->se_bi)
     {
       (*sep->se_bi->bi_fn) (ctrl, sep);
@@ -429,63 +555,728 @@ run_service (int ctrl, struct servtab *sep)
       close (ctrl);
       dup2 (0, 1);
       dup2 (0, 2);
-      pwd = getpwnam (sep->se_user);
-      if (pwd == NULL)
+      exec_service (sep);
+    }
+}
+
+#ifdef HAVE_POSIX_SPAWN
+extern char **environ;
+
+/*
+ * Start the server of SEP on CTRL without forking inetd.  This is
+ * for servers that run as root, since posix_spawn cannot change the
+ * credentials.  Return the pid, or -1 with errno set.
+ */
+pid_t
+spawn_service (struct servtab *sep, int ctrl)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t none;
+  pid_t pid;
+  int err;
+
+  sigemptyset (&none);
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_adddup2 (&actions, ctrl, 0);
+  if (ctrl > 2)
+    posix_spawn_file_actions_addclose (&actions, ctrl);
+  posix_spawn_file_actions_adddup2 (&actions, 0, 1);
+  posix_spawn_file_actions_adddup2 (&actions, 0, 2);
+  posix_spawnattr_init (&attr);
+  posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK);
+  posix_spawnattr_setsigmask (&attr, &none);
+
+  err = posix_spawn (&pid, sep->se_server, &actions, &attr,
+		     sep->se_argv, environ);
+
+  posix_spawnattr_destroy (&attr);
+  posix_spawn_file_actions_destroy (&actions);
+  if (err)
+    {
+      errno = err;
+      return -1;
+    }
+  return pid;
+}
+#endif
+
+/*
+ * Pools of pre-forked workers, see the option `prefork'.  The workers
+ * of a service share as their standard input one end of a seqpacket
+ * socket pair, over which inetd passes accepted connections with
+ * SCM_RIGHTS.  Whichever worker waits takes the next connection.  A
+ * message without a descriptor, or end of file once inetd is gone,
+ * asks a worker to exit.  Workers write
+ * a byte to their standard output, a pipe shared with inetd, whenever
+ * they have finished a connection.  That pipe is polled, with the
+ * address of the service plus POOL_TAG as epoll data.
+ */
+struct pool
+{
+  int p_fd;			/* passes connections to workers */
+  int p_wfd;			/* the end of the workers */
+  int p_done[2];		/* pipe of finished connections */
+  pid_t *p_pids;		/* running workers */
+  unsigned p_nworkers;		/* number of the same */
+  unsigned p_busy;		/* connections not yet finished */
+  time_t p_fulltime;		/* last time no worker was spare */
+};
+
+#define POOL_TAG	2
+
+unsigned npools;		/* pools running */
+
+/*
+ * Start a worker for SEP.  Return zero on success.
+ */
+int
+pool_spawn (struct servtab *sep)
+{
+  struct pool *p = sep->se_pool;
+  SIGSTATUS sigstatus;
+  pid_t pid;
+  int fd;
+
+  signal_block (&sigstatus);
+  pid = fork ();
+  if (pid < 0)
+    {
+      syslog (LOG_ERR, "fork: %m");
+      signal_unblock (&sigstatus);
+      return -1;
+    }
+  if (pid == 0)
+    {
+      signal_unblock (NULL);
+      if (debug)
 	{
-	  syslog (LOG_ERR, "%s/%s: %s: No such user",
-		  sep->se_service, sep->se_proto, sep->se_user);
-	  if (sep->se_socktype != SOCK_STREAM)
-	    recv (0, buf, sizeof buf, 0);
-	  _exit (EXIT_FAILURE);
+	  fprintf (stderr, "%d execl %s (worker)\n", (int) getpid (),
+		   sep->se_server);
+	  setsid ();
 	}
-      if (sep->se_group && *sep->se_group)
+      dup2 (p->p_wfd, 0);
+      dup2 (p->p_done[1], 1);
+      fd = open (PATH_DEVNULL, O_RDWR);
+      if (fd >= 0 && fd != 2)
 	{
-	  grp = getgrnam (sep->se_group);
-	  if (grp == NULL)
-	    {
-	      syslog (LOG_ERR, "%s/%s: %s: No such group",
-		      sep->se_service, sep->se_proto, sep->se_group);
-	      if (sep->se_socktype != SOCK_STREAM)
-		recv (0, buf, sizeof buf, 0);
-	      _exit (EXIT_FAILURE);
-	    }
+	  dup2 (fd, 2);
+	  close (fd);
 	}
-      if (pwd->pw_uid)
+      exec_service (sep);
+    }
+  p->p_pids[p->p_nworkers++] = pid;
+  signal_unblock (&sigstatus);
+  return 0;
+}
+
+/*
+ * Create the pool of SEP, with its minimal number of workers.
+ */
+void
+pool_start (struct servtab *sep)
+{
+  struct pool *p;
+  int sv[2] = { -1, -1 };
+
+  p = calloc (1, sizeof (*p));
+  if (p)
+    p->p_pids = calloc (sep->se_pmax, sizeof (*p->p_pids));
+  if (!p || !p->p_pids)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      if (p)
+	free (p);
+      return;
+    }
+
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0 || pipe (p->p_done) < 0)
+    {
+      syslog (LOG_ERR, "%s/%s: prefork: %m", sep->se_service, sep->se_proto);
+      if (sv[0] >= 0)
 	{
-	  if (grp && grp->gr_gid)
-	    {
-	      if (setgid (grp->gr_gid) < 0)
-		{
-		  syslog (LOG_ERR, "%s: can't set gid %d: %m",
-			  sep->se_service, grp->gr_gid);
-		  _exit (EXIT_FAILURE);
-		}
-	    }
-	  else if (setgid (pwd->pw_gid) < 0)
-	    {
-	      syslog (LOG_ERR, "%s: can't set gid %d: %m",
-		      sep->se_service, pwd->pw_gid);
-	      _exit (EXIT_FAILURE);
-	    }
-#ifdef HAVE_INITGROUPS
-	  initgroups (pwd->pw_name,
-		      (grp && grp->gr_gid) ? grp->gr_gid : pwd->pw_gid);
+	  close (sv[0]);
+	  close (sv[1]);
+	}
+      free (p->p_pids);
+      free (p);
+      return;
+    }
+  p->p_fd = sv[0];
+  p->p_wfd = sv[1];
+  fcntl (p->p_fd, F_SETFD, FD_CLOEXEC);
+  fcntl (p->p_wfd, F_SETFD, FD_CLOEXEC);
+  fcntl (p->p_done[0], F_SETFD, FD_CLOEXEC);
+  fcntl (p->p_done[1], F_SETFD, FD_CLOEXEC);
+  fcntl (p->p_fd, F_SETFL, O_NONBLOCK);
+  fcntl (p->p_done[0], F_SETFL, O_NONBLOCK);
+  maxsock = MAX (maxsock, MAX (MAX (sv[0], sv[1]),
+			       MAX (p->p_done[0], p->p_done[1])));
+  p->p_fulltime = time (NULL);
+  sep->se_pool = p;
+  npools++;
+
+#ifdef HAVE_SYS_EPOLL_H
+  {
+    struct epoll_event ev;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uintptr_t) sep | POOL_TAG;
+    if (epoll_ctl (epfd, EPOLL_CTL_ADD, p->p_done[0], &ev) < 0)
+      syslog (LOG_ERR, "%s/%s: epoll_ctl: %m",
+	      sep->se_service, sep->se_proto);
+  }
+#else
+  FD_SET (p->p_done[0], &allsock);
 #endif
-	  if (setuid (pwd->pw_uid) < 0)
-	    {
-	      syslog (LOG_ERR, "%s: can't set uid %d: %m",
-		      sep->se_service, pwd->pw_uid);
-	      _exit (EXIT_FAILURE);
-	    }
+
+  while (p->p_nworkers < sep->se_pmin && pool_spawn (sep) == 0)
+    ;
+}
+
+/*
+ * Let the workers of SEP exit, idle ones at once, busy ones
+ * after their connection.
+ */
+void
+pool_stop (struct servtab *sep)
+{
+  struct pool *p = sep->se_pool;
+  unsigned i;
+
+  if (!p)
+    return;
+
+  for (i = 0; i < p->p_nworkers; i++)
+    if (send (p->p_fd, "q", 1, 0) < 0)
+      kill (p->p_pids[i], SIGTERM);
+
+#ifdef HAVE_SYS_EPOLL_H
+  {
+    struct epoll_event ev;
+
+    epoll_ctl (epfd, EPOLL_CTL_DEL, p->p_done[0], &ev);
+  }
+#else
+  FD_CLR (p->p_done[0], &allsock);
+#endif
+  npools--;
+  close (p->p_fd);
+  close (p->p_wfd);
+  close (p->p_done[0]);
+  close (p->p_done[1]);
+  free (p->p_pids);
+  free (p);
+  sep->se_pool = NULL;
+}
+
+/*
+ * Forget the worker PID of SEP, which has exited.  Return true if
+ * it was one.
+ */
+bool
+pool_reaped (struct servtab *sep, pid_t pid)
+{
+  struct pool *p = sep->se_pool;
+  unsigned i;
+
+  for (i = 0; i < p->p_nworkers; i++)
+    if (p->p_pids[i] == pid)
+      {
+	p->p_pids[i] = p->p_pids[--p->p_nworkers];
+	if (p->p_busy > p->p_nworkers)
+	  p->p_busy = p->p_nworkers;
+	return true;
+      }
+  return false;
+}
+
+/*
+ * Count the connections the workers of SEP have finished.
+ */
+void
+pool_drain (struct servtab *sep)
+{
+  struct pool *p = sep->se_pool;
+  char buf[256];
+  ssize_t n;
+
+  while ((n = read (p->p_done[0], buf, sizeof buf)) > 0)
+    p->p_busy -= MIN ((unsigned) n, p->p_busy);
+}
+
+/*
+ * Stop one worker of SEP if some have been spare for PREFORK_IDLE
+ * seconds.
+ */
+void
+pool_trim (struct servtab *sep, time_t now)
+{
+  struct pool *p = sep->se_pool;
+
+  if (p->p_busy + 1 >= p->p_nworkers || p->p_nworkers <= sep->se_pmin)
+    p->p_fulltime = now;
+  else if (now - p->p_fulltime >= PREFORK_IDLE)
+    {
+      send (p->p_fd, "q", 1, 0);
+      p->p_fulltime = now;
+    }
+}
+
+/*
+ * Shrink the pools that went idle.  Called from the main loop, which
+ * wakes up every PREFORK_CHECK seconds while there are pools.
+ */
+void
+pool_check (void)
+{
+  static time_t next;
+  struct servtab *sep;
+  time_t now;
+
+  if (!npools)
+    return;
+  now = time (NULL);
+  if (now < next)
+    return;
+  next = now + PREFORK_CHECK;
+  for (sep = servtab; sep; sep = sep->se_next)
+    if (sep->se_pool)
+      {
+	pool_drain (sep);
+	pool_trim (sep, now);
+      }
+}
+
+/*
+ * Hand the connection CTRL to a worker of SEP.  The pool grows when
+ * every worker is busy.  A connection finds no worker when too many
+ * wait for one already, and is then counted as rejected.
+ */
+void
+pool_dispatch (struct servtab *sep, int ctrl)
+{
+  struct pool *p = sep->se_pool;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (sizeof (int))];
+  } control;
+
+  pool_drain (sep);
+
+  while (p->p_nworkers < sep->se_pmin
+	 || (p->p_busy >= p->p_nworkers && p->p_nworkers < sep->se_pmax))
+    if (pool_spawn (sep))
+      break;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = "c";
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &ctrl, sizeof (int));
+
+  if (sendmsg (p->p_fd, &msg, 0) < 0)
+    {
+      sep->se_rejected++;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	{
+	  /* The workers fall behind; another one helps if allowed.  */
+	  if (p->p_nworkers < sep->se_pmax)
+	    pool_spawn (sep);
+	  if (debug)
+	    fprintf (stderr, "%s/%s: workers busy, connection refused\n",
+		     sep->se_service, sep->se_proto);
 	}
-      execv (sep->se_server, sep->se_argv);
-      if (sep->se_socktype != SOCK_STREAM)
-	recv (0, buf, sizeof buf, 0);
-      syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
-      _exit (EXIT_FAILURE);
+      else
+	syslog (LOG_WARNING, "%s/%s: no worker takes connections: %m",
+		sep->se_service, sep->se_proto);
+      return;
+    }
+  p->p_busy++;
+  sep->se_accepted++;
+  pool_trim (sep, time (NULL));
+}
+
+/*
+ * Start polling the socket of SEP.  With epoll, the socket of a nowait
+ * stream service is edge triggered and non-blocking, and every wakeup
+ * accepts connections until the backlog is empty.  MODIFY is set for a
+ * socket polled already, whose service may have changed.
+ */
+void
+watch_sep (struct servtab *sep, int modify)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  int flags;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = sep;
+
+  flags = fcntl (sep->se_fd, F_GETFL);
+  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+    {
+      ev.events |= EPOLLET;
+      flags |= O_NONBLOCK;
+    }
+  else
+    flags &= ~O_NONBLOCK;
+  fcntl (sep->se_fd, F_SETFL, flags);
+
+  if (epoll_ctl (epfd, modify ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		 sep->se_fd, &ev) < 0)
+    syslog (LOG_ERR, "%s/%s: epoll_ctl: %m", sep->se_service, sep->se_proto);
+#else
+  if (modify)
+    return;
+  FD_SET (sep->se_fd, &allsock);
+#endif
+  if (!modify)
+    nsock++;
+}
+
+/*
+ * Stop polling the socket of SEP.
+ */
+void
+unwatch_sep (struct servtab *sep)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+
+  /* A child holding the socket would keep it registered, even
+     after it is closed here.  */
+  epoll_ctl (epfd, EPOLL_CTL_DEL, sep->se_fd, &ev);
+#else
+  FD_CLR (sep->se_fd, &allsock);
+#endif
+  nsock--;
+}
+
+/*
+ * Clients of each service, hashed by service and address, counting
+ * its children and connections for the per-source limit.
+ */
+struct source
+{
+  struct source *s_next;
+  struct source **s_chain;	/* head of the hash chain */
+  struct servtab *s_sep;
+  int s_family;
+  union
+  {
+    struct in_addr s_in;
+#ifdef IPV6
+    struct in6_addr s_in6;
+#endif
+  } s_addr;
+  unsigned s_count;		/* running children and connections */
+};
+
+#define SOURCE_HASH 251
+struct source *sources[SOURCE_HASH];
+
+/*
+ * Running children, hashed by pid.  Each child is accounted to its
+ * service and to its client.
+ */
+struct child
+{
+  struct child *c_next;
+  pid_t c_pid;
+  struct servtab *c_sep;	/* NULL once the service is removed */
+  struct source *c_src;		/* client, if any */
+  struct timeval c_start;
+};
+
+#define CHILD_HASH 251
+struct child *children[CHILD_HASH];
+
+/*
+ * Connections of stream builtins served by inetd itself, rather than
+ * by a child, when epoll is available.  Their epoll data is the
+ * address of the connection with CONN_TAG added, which tells them
+ * from services.
+ */
+struct conn
+{
+  struct conn *c_next;
+  struct conn *c_prev;
+  int c_fd;
+  uint32_t c_events;		/* events polled for */
+  struct servtab *c_sep;	/* NULL once the service is removed */
+  struct biltin *c_bi;
+  struct source *c_src;		/* client, if any */
+  struct timeval c_start;
+  char *c_buf;			/* echo: data not yet sent back */
+  size_t c_len;			/* echo: bytes in c_buf */
+  size_t c_off;			/* echo: bytes sent; chargen: offset */
+  unsigned long long c_bytes;	/* data transferred */
+};
+
+#define CONN_TAG	1
+
+/* Connections are refused once their descriptor comes this close to
+   the limit of open files, leaving room to accept and start the
+   other services.  */
+#define CONN_FD_RESERVE	32
+
+struct conn *conns;
+int conn_fdmax = INT_MAX;	/* first descriptor refused */
+
+/*
+ * Return the hash chain of the client SA of SEP, and fill in SRC with
+ * its key.  Return NULL if SA is not an internet address.
+ */
+struct source **
+source_chain (struct servtab *sep, struct sockaddr *sa, struct source *src)
+{
+  unsigned char *p;
+  size_t i, len;
+  unsigned long h;
+
+  memset (src, 0, sizeof (*src));
+  src->s_sep = sep;
+  src->s_family = sa->sa_family;
+  switch (sa->sa_family)
+    {
+    case AF_INET:
+      src->s_addr.s_in = ((struct sockaddr_in *) sa)->sin_addr;
+      len = sizeof (struct in_addr);
+      break;
+#ifdef IPV6
+    case AF_INET6:
+      src->s_addr.s_in6 = ((struct sockaddr_in6 *) sa)->sin6_addr;
+      len = sizeof (struct in6_addr);
+      break;
+#endif
+    default:
+      return NULL;
+    }
+
+  h = (uintptr_t) sep >> 4;
+  for (p = (unsigned char *) &src->s_addr, i = 0; i < len; i++)
+    h = h * 31 + p[i];
+  return &sources[h % SOURCE_HASH];
+}
+
+/*
+ * Return the number of children and connections of SEP for the
+ * client SA.
+ */
+unsigned
+source_count (struct servtab *sep, struct sockaddr *sa)
+{
+  struct source key, **sp, *s;
+
+  sp = source_chain (sep, sa, &key);
+  if (!sp)
+    return 0;
+  for (s = *sp; s; s = s->s_next)
+    if (s->s_sep == sep && s->s_family == key.s_family
+	&& memcmp (&s->s_addr, &key.s_addr, sizeof (key.s_addr)) == 0)
+      return s->s_count;
+  return 0;
+}
+
+/*
+ * Count one more child or connection of SEP for the client SA, and
+ * return its entry, or NULL if SA is not counted.
+ */
+struct source *
+source_hold (struct servtab *sep, struct sockaddr *sa)
+{
+  struct source key, **sp, *s;
+
+  if (!sa)
+    return NULL;
+  sp = source_chain (sep, sa, &key);
+  if (!sp)
+    return NULL;
+  for (s = *sp; s; s = s->s_next)
+    if (s->s_sep == sep && s->s_family == key.s_family
+	&& memcmp (&s->s_addr, &key.s_addr, sizeof (key.s_addr)) == 0)
+      break;
+  if (!s)
+    {
+      s = malloc (sizeof (*s));
+      if (!s)
+	return NULL;
+      *s = key;
+      s->s_chain = sp;
+      s->s_next = *sp;
+      *sp = s;
+    }
+  s->s_count++;
+  return s;
+}
+
+/*
+ * Drop one child or connection from the client entry S.
+ */
+void
+source_release (struct source *s)
+{
+  struct source **sp;
+
+  if (!s || --s->s_count)
+    return;
+  for (sp = s->s_chain; *sp != s; sp = &(*sp)->s_next)
+    ;
+  *sp = s->s_next;
+  free (s);
+}
+
+void
+child_add (struct servtab *sep, pid_t pid, struct sockaddr *sa)
+{
+  struct child *c = calloc (1, sizeof (*c));
+
+  if (!c)
+    return;
+  c->c_pid = pid;
+  c->c_sep = sep;
+  c->c_src = source_hold (sep, sa);
+  gettimeofday (&c->c_start, NULL);
+  c->c_next = children[pid % CHILD_HASH];
+  children[pid % CHILD_HASH] = c;
+  sep->se_active++;
+}
+
+/*
+ * Account for the exit of child PID.
+ */
+void
+child_reaped (pid_t pid)
+{
+  struct child **cp, *c;
+  struct timeval now;
+
+  for (cp = &children[pid % CHILD_HASH]; (c = *cp); cp = &c->c_next)
+    if (c->c_pid == pid)
+      break;
+  if (!c)
+    return;
+  *cp = c->c_next;
+  if (c->c_sep)
+    {
+      gettimeofday (&now, NULL);
+      c->c_sep->se_active--;
+      c->c_sep->se_exited++;
+      c->c_sep->se_runtime += (now.tv_sec - c->c_start.tv_sec) * 1000LL
+	+ (now.tv_usec - c->c_start.tv_usec) / 1000;
+      source_release (c->c_src);
+    }
+  free (c);
+}
+
+/*
+ * Detach the children and connections of SEP, which is about to
+ * be freed.  Their client entries go too, since a later service
+ * could be allocated at the same address.
+ */
+void
+child_forget (struct servtab *sep)
+{
+  struct child *c;
+  struct conn *cn;
+  int i;
+
+  for (i = 0; i < CHILD_HASH; i++)
+    for (c = children[i]; c; c = c->c_next)
+      if (c->c_sep == sep)
+	{
+	  source_release (c->c_src);
+	  c->c_src = NULL;
+	  c->c_sep = NULL;
+	}
+  for (cn = conns; cn; cn = cn->c_next)
+    if (cn->c_sep == sep)
+      {
+	source_release (cn->c_src);
+	cn->c_src = NULL;
+	cn->c_sep = NULL;
+      }
+}
+
+/*
+ * Return true if a connection from SA would take SEP over its
+ * limits of running children.
+ */
+bool
+over_limits (struct servtab *sep, struct sockaddr *sa)
+{
+  if (sep->se_instances && sep->se_active >= sep->se_instances)
+    return true;
+  return sep->se_persource
+    && source_count (sep, sa) >= sep->se_persource;
+}
+
+/*
+ * Write the statistics of all services to stats_file.
+ */
+void
+write_stats (int signo MAYBE_UNUSED)
+{
+  struct servtab *sep;
+  struct timeval now;
+  char *tmp;
+  FILE *fp;
+
+  tmp = malloc (strlen (stats_file) + sizeof (".new"));
+  if (!tmp)
+    return;
+  sprintf (tmp, "%s.new", stats_file);
+  fp = fopen (tmp, "w");
+  if (!fp)
+    {
+      syslog (LOG_ERR, "%s: %m", tmp);
+      free (tmp);
+      return;
+    }
+
+  gettimeofday (&now, NULL);
+  fprintf (fp, "# inetd statistics at %.24s\n", ctime (&now.tv_sec));
+  for (sep = servtab; sep; sep = sep->se_next)
+    {
+      double secs = (now.tv_sec - sep->se_lasttime.tv_sec)
+	+ (now.tv_usec - sep->se_lasttime.tv_usec) / 1e6;
+      unsigned active = sep->se_pool ? sep->se_pool->p_busy : sep->se_active;
+
+      fprintf (fp, "service name=%s/%s node=%s listener=%u accepted=%lu"
+	       " rate=%.2f active=%u rejected=%lu exited=%lu lifetime=%.3f\n",
+	       sep->se_service, sep->se_proto,
+	       sep->se_node ? sep->se_node : "*", sep->se_listener,
+	       sep->se_accepted,
+	       secs > 0 ? (sep->se_accepted - sep->se_lastaccepted) / secs : 0,
+	       active, sep->se_rejected, sep->se_exited,
+	       sep->se_exited ? sep->se_runtime / 1e3 / sep->se_exited : 0);
+      sep->se_lastaccepted = sep->se_accepted;
+      sep->se_lasttime = now;
+    }
+
+  if (fclose (fp) != 0 || rename (tmp, stats_file) < 0)
+    {
+      syslog (LOG_ERR, "%s: %m", stats_file);
+      unlink (tmp);
     }
+  free (tmp);
 }
 
+
 void
 reapchild (int signo MAYBE_UNUSED)
 {
@@ -504,8 +1295,16 @@ reapchild (int signo MAYBE_UNUSED)
 	break;
       if (debug)
 	fprintf (stderr, "%d reaped, status %#x\n", (int) pid, status);
+      child_reaped (pid);
       for (sep = servtab; sep; sep = sep->se_next)
-	if (sep->se_wait == pid)
+	if (sep->se_pool && pool_reaped (sep, pid))
+	  {
+	    if (status)
+	      syslog (LOG_WARNING, "%s: exit status 0x%x",
+		      sep->se_server, status);
+	    break;
+	  }
+	else if (sep->se_wait == pid)
 	  {
 	    if (status)
 	      syslog (LOG_WARNING, "%s: exit status 0x%x",
@@ -513,9 +1312,8 @@ reapchild (int signo MAYBE_UNUSED)
 	    if (debug)
 	      fprintf (stderr, "restored %s, fd %d\n",
 		       sep->se_service, sep->se_fd);
-	    FD_SET (sep->se_fd, &allsock);
-	    nsock++;
 	    sep->se_wait = 1;
+	    watch_sep (sep, 0);
 	  }
     }
 }
@@ -604,6 +1402,8 @@ setup (struct servtab *sep)
 	      sep->se_service, sep->se_proto);
       return 1;
     }
+  /* Servers get their socket on standard input only.  */
+  fcntl (sep->se_fd, F_SETFD, FD_CLOEXEC);
 #ifdef IPV6
   if (sep->se_family == AF_INET6)
     {
@@ -630,6 +1430,13 @@ setup (struct servtab *sep)
   if (err < 0)
     syslog (LOG_ERR, "setsockopt (SO_REUSEADDR): %m");
 
+#ifdef SO_REUSEPORT
+  if (sep->se_listeners > 1
+      && setsockopt (sep->se_fd, SOL_SOCKET, SO_REUSEPORT,
+		     (char *) &on, sizeof (on)) < 0)
+    syslog (LOG_ERR, "setsockopt (SO_REUSEPORT): %m");
+#endif
+
   err = bind (sep->se_fd, (struct sockaddr *) &sep->se_ctrladdr,
 	      sep->se_addrlen);
   if (err < 0)
@@ -671,6 +1478,37 @@ setup (struct servtab *sep)
   return 0;
 }
 
+/*
+ * Set the options of the listening stream socket of SEP, and have it
+ * listen.  This is repeated when the configuration is reread.
+ */
+void
+listen_sep (struct servtab *sep)
+{
+  int val;
+
+  if (strncmp (sep->se_proto, "tcp", 3) == 0)
+    {
+#ifdef TCP_DEFER_ACCEPT
+      val = sep->se_deferaccept;
+      if (setsockopt (sep->se_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		      (char *) &val, sizeof (val)) < 0 && val)
+	syslog (LOG_ERR, "%s/%s: setsockopt (TCP_DEFER_ACCEPT): %m",
+		sep->se_service, sep->se_proto);
+#endif
+#ifdef TCP_FASTOPEN
+      val = sep->se_fastopen;
+      if (setsockopt (sep->se_fd, IPPROTO_TCP, TCP_FASTOPEN,
+		      (char *) &val, sizeof (val)) < 0 && val)
+	syslog (LOG_ERR, "%s/%s: setsockopt (TCP_FASTOPEN): %m",
+		sep->se_service, sep->se_proto);
+#endif
+    }
+  val = sep->se_backlog ? sep->se_backlog : SOMAXCONN;
+  if (listen (sep->se_fd, val) < 0)
+    syslog (LOG_ERR, "%s/%s: listen: %m", sep->se_service, sep->se_proto);
+}
+
 void
 servent_setup (struct servtab *sep)
 {
@@ -678,14 +1516,22 @@ servent_setup (struct servtab *sep)
   if (sep->se_fd == -1 && setup (sep) == 0)
     {
       if (sep->se_socktype == SOCK_STREAM)
-	listen (sep->se_fd, 10);
-      FD_SET (sep->se_fd, &allsock);
-      nsock++;
+	listen_sep (sep);
+      watch_sep (sep, 0);
       if (sep->se_fd > maxsock)
 	maxsock = sep->se_fd;
       if (debug)
 	fprintf (stderr, "registered %s on %d\n", sep->se_server, sep->se_fd);
     }
+  else if (sep->se_fd >= 0 && sep->se_wait <= 1)
+    {
+      watch_sep (sep, 1);	/* wait or nowait may have changed */
+      if (sep->se_socktype == SOCK_STREAM)
+	listen_sep (sep);
+    }
+
+  if (sep->se_fd >= 0 && sep->se_pmax && !sep->se_pool)
+    pool_start (sep);
 }
 
 void
@@ -707,11 +1553,11 @@ close_sep (struct servtab *sep)
 {
   if (sep->se_fd >= 0)
     {
-      nsock--;
-      FD_CLR (sep->se_fd, &allsock);
+      unwatch_sep (sep);
       close (sep->se_fd);
       sep->se_fd = -1;
     }
+  pool_stop (sep);
   sep->se_count = 0;
   /*
    * Don't keep the pid of this running deamon: when reapchild()
@@ -721,6 +1567,55 @@ close_sep (struct servtab *sep)
     sep->se_wait = 1;
 }
 
+#define STREQ(a, b)	((a) == (b) || ((a) && (b) && strcmp (a, b) == 0))
+
+unsigned
+strhash (unsigned h, const char *s)
+{
+  if (s)
+    while (*s)
+      h = h * 31 + (unsigned char) *s++;
+  return h;
+}
+
+struct servtab **
+servhash_bucket (struct servtab *sep)
+{
+  return &servhash[strhash (strhash (0, sep->se_service), sep->se_proto)
+		   % SERVHASH];
+}
+
+void
+servhash_remove (struct servtab *sep)
+{
+  struct servtab **pp;
+
+  for (pp = servhash_bucket (sep); *pp; pp = &(*pp)->se_hnext)
+    if (*pp == sep)
+      {
+	*pp = sep->se_hnext;
+	break;
+      }
+}
+
+/*
+ * Return true if A and B run the same server as the same user.
+ */
+bool
+same_invocation (struct servtab *a, struct servtab *b)
+{
+  size_t i;
+
+  if (!STREQ (a->se_server, b->se_server) || !STREQ (a->se_user, b->se_user)
+      || !STREQ (a->se_group, b->se_group) || a->se_uid != b->se_uid
+      || a->se_gid != b->se_gid || a->se_argc != b->se_argc)
+    return false;
+  for (i = 0; i < a->se_argc; i++)
+    if (!STREQ (a->se_argv[i], b->se_argv[i]))
+      return false;
+  return true;
+}
+
 struct servtab *
 enter (struct servtab *cp)
 {
@@ -729,12 +1624,13 @@ enter (struct servtab *cp)
   size_t i;
 
   /* Checking/Removing duplicates */
-  for (sep = servtab; sep; sep = sep->se_next)
+  for (sep = *servhash_bucket (cp); sep; sep = sep->se_hnext)
     if (memcmp (&sep->se_ctrladdr, &cp->se_ctrladdr,
 		sizeof (sep->se_ctrladdr)) == 0
 	&& strcmp (sep->se_service, cp->se_service) == 0
 	&& strcmp (sep->se_proto, cp->se_proto) == 0
-	&& ISMUX (sep) == ISMUX (cp))
+	&& ISMUX (sep) == ISMUX (cp)
+	&& sep->se_listener == cp->se_listener)
       break;
   if (sep != 0)
     {
@@ -747,6 +1643,25 @@ enter (struct servtab *cp)
        */
       if (cp->se_bi == 0 && (sep->se_wait == 1 || cp->se_wait == 0))
 	sep->se_wait = cp->se_wait;
+      /* Workers run the old server.  */
+      if (sep->se_pool && (sep->se_pmin != cp->se_pmin
+			   || sep->se_pmax != cp->se_pmax
+			   || !same_invocation (sep, cp)))
+	pool_stop (sep);
+      sep->se_pmin = cp->se_pmin;
+      sep->se_pmax = cp->se_pmax;
+      sep->se_instances = cp->se_instances;
+      sep->se_persource = cp->se_persource;
+      sep->se_report = cp->se_report;
+      /* Only sockets bound with SO_REUSEPORT can share the address,
+	 so the first one is bound anew for new sharing ones.  A socket
+	 that no longer shares it may keep the option.  */
+      if (sep->se_listeners <= 1 && cp->se_listeners > 1)
+	close_sep (sep);
+      sep->se_listeners = cp->se_listeners;
+      sep->se_backlog = cp->se_backlog;
+      sep->se_deferaccept = cp->se_deferaccept;
+      sep->se_fastopen = cp->se_fastopen;
 #define SWAP(a, b) { char *c = a; a = b; b = c; }
       if (cp->se_user)
 	SWAP (sep->se_user, cp->se_user);
@@ -754,11 +1669,22 @@ enter (struct servtab *cp)
 	SWAP (sep->se_group, cp->se_group);
       if (cp->se_server)
 	SWAP (sep->se_server, cp->se_server);
+      sep->se_uid = cp->se_uid;
+      sep->se_gid = cp->se_gid;
+      free (sep->se_groups);
+      sep->se_groups = cp->se_groups;
+      sep->se_ngroups = cp->se_ngroups;
+      if (sep->se_groups)
+	dupmem ((void**)&sep->se_groups,
+		sep->se_ngroups * sizeof (sep->se_groups[0]));
       argcv_free (sep->se_argc, sep->se_argv);
       sep->se_argc = cp->se_argc;
       sep->se_argv = cp->se_argv;
       cp->se_argc = 0;
       cp->se_argv = NULL;
+      sep->se_file = cp->se_file;
+      sep->se_line = cp->se_line;
+      sep->se_cf = cp->se_cf;
       sep->se_checked = 1;
       signal_unblock (&sigstatus);
       if (debug)
@@ -781,15 +1707,21 @@ enter (struct servtab *cp)
   dupstr (&sep->se_proto);
   dupstr (&sep->se_user);
   dupstr (&sep->se_group);
+  if (sep->se_groups)
+    dupmem ((void**)&sep->se_groups,
+	    sep->se_ngroups * sizeof (sep->se_groups[0]));
   dupstr (&sep->se_server);
   dupmem ((void**)&sep->se_argv, sep->se_argc * sizeof (sep->se_argv[0]));
   for (i = 0; i < sep->se_argc; i++)
     dupstr (&sep->se_argv[i]);
 
   sep->se_fd = -1;
+  gettimeofday (&sep->se_lasttime, NULL);
   signal_block (&sigstatus);
   sep->se_next = servtab;
   servtab = sep;
+  sep->se_hnext = *servhash_bucket (sep);
+  *servhash_bucket (sep) = sep;
   signal_unblock (&sigstatus);
   return sep;
 }
@@ -797,6 +1729,87 @@ enter (struct servtab *cp)
 #define IPV4_NUMCHARS ".0123456789"
 #define IPV6_NUMCHARS ".:0123456789abcdefABCDEF"
 
+/*
+ * Results of getaddrinfo, kept while the configuration is read.
+ */
+struct aicache
+{
+  struct aicache *ac_next;
+  char *ac_node;
+  char *ac_service;
+  struct addrinfo ac_hints;
+  int ac_err;
+  struct addrinfo *ac_result;
+};
+
+#define AICACHE_HASH 1021
+struct aicache *aicache[AICACHE_HASH];
+
+/*
+ * Like getaddrinfo, but return a result found already while reading
+ * this configuration.  The caller must not free the result.
+ */
+int
+cached_getaddrinfo (const char *node, const char *service,
+		    const struct addrinfo *hints, struct addrinfo **result)
+{
+  struct aicache *ac, **bucket;
+
+  bucket = &aicache[strhash (strhash (hints->ai_family, node), service)
+		    % AICACHE_HASH];
+  for (ac = *bucket; ac; ac = ac->ac_next)
+    if (STREQ (ac->ac_node, node) && STREQ (ac->ac_service, service)
+	&& ac->ac_hints.ai_flags == hints->ai_flags
+	&& ac->ac_hints.ai_family == hints->ai_family
+	&& ac->ac_hints.ai_socktype == hints->ai_socktype
+	&& ac->ac_hints.ai_protocol == hints->ai_protocol)
+      {
+	*result = ac->ac_result;
+	return ac->ac_err;
+      }
+
+  ac = calloc (1, sizeof (*ac));
+  if (!ac)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      exit (-1);
+    }
+  ac->ac_node = node ? newstr (node) : NULL;
+  ac->ac_service = newstr (service);
+  ac->ac_hints = *hints;
+  ac->ac_err = getaddrinfo (node, service, hints, &ac->ac_result);
+  if (ac->ac_err == EAI_SYSTEM)
+    {
+      /* Leave it to be tried again.  */
+      free (ac->ac_node);
+      free (ac->ac_service);
+      free (ac);
+      return EAI_SYSTEM;
+    }
+  ac->ac_next = *bucket;
+  *bucket = ac;
+  *result = ac->ac_result;
+  return ac->ac_err;
+}
+
+void
+flush_aicache (void)
+{
+  struct aicache *ac;
+  int i;
+
+  for (i = 0; i < AICACHE_HASH; i++)
+    while ((ac = aicache[i]))
+      {
+	aicache[i] = ac->ac_next;
+	if (ac->ac_result)
+	  freeaddrinfo (ac->ac_result);
+	free (ac->ac_node);
+	free (ac->ac_service);
+	free (ac);
+      }
+}
+
 int
 inetd_getaddrinfo (struct servtab *sep, int proto, struct addrinfo **result)
 {
@@ -837,7 +1850,7 @@ inetd_getaddrinfo (struct servtab *sep, int proto, struct addrinfo **result)
   hints.ai_socktype = sep->se_socktype;
   hints.ai_protocol = proto;
 
-  return getaddrinfo (sep->se_node, sep->se_service, &hints, result);
+  return cached_getaddrinfo (sep->se_node, sep->se_service, &hints, result);
 }
 
 int
@@ -905,12 +1918,15 @@ expand_enter (struct servtab *sep)
       memset (&sep->se_ctrladdr, 0, sizeof (sep->se_ctrladdr));
       memcpy (&sep->se_ctrladdr, rp->ai_addr, rp->ai_addrlen);
       sep->se_addrlen = rp->ai_addrlen;
-      cp = enter (sep);
-      servent_setup (cp);
+      sep->se_listener = 0;
+      do
+	{
+	  cp = enter (sep);
+	  servent_setup (cp);
+	}
+      while (++sep->se_listener < sep->se_listeners);
     }
 
-  freeaddrinfo (result);
-
   return 0;
 }
 
@@ -944,6 +1960,7 @@ freeconfig (struct servtab *cp)
   free (cp->se_proto);
   free (cp->se_user);
   free (cp->se_group);
+  free (cp->se_groups);
   free (cp->se_server);
   argcv_free (cp->se_argc, cp->se_argv);
 }
@@ -984,6 +2001,91 @@ next_node_sep (struct servtab *sep)
   return sep;
 }
 
+/*
+ * Set *N to VALUE, the positive number given to option OPT.
+ */
+void
+option_number (const char *opt, const char *value, unsigned *n,
+	       const char *file, size_t line)
+{
+  unsigned long num = 0;
+  char *p = NULL;
+
+  if (value)
+    num = strtoul (value, &p, 10);
+  if (!value || *p || num == 0 || num > UINT_MAX)
+    syslog (LOG_WARNING, "%s:%lu: invalid value of %s (%s)",
+	    file, (unsigned long) line, opt, value ? value : "");
+  else
+    *n = num;
+}
+
+/*
+ * Parse OPT, an option of the form NAME=VALUE following the
+ * wait field of an entry.
+ */
+void
+service_option (struct servtab *sep, char *opt, const char *file,
+		size_t line)
+{
+  char *value, *p;
+
+  value = strchr (opt, '=');
+  if (value)
+    *value++ = 0;
+
+  if (strcmp (opt, "prefork") == 0 && value)
+    {
+      sep->se_pmin = sep->se_pmax = strtoul (value, &p, 10);
+      if (*p == ':')
+	sep->se_pmax = strtoul (p + 1, &p, 10);
+      if (*p || sep->se_pmax == 0 || sep->se_pmin > sep->se_pmax)
+	{
+	  syslog (LOG_WARNING, "%s:%lu: invalid prefork limits (%s)",
+		  file, (unsigned long) line, value);
+	  sep->se_pmin = sep->se_pmax = 0;
+	}
+    }
+  else if (strcmp (opt, "instances") == 0)
+    option_number (opt, value, &sep->se_instances, file, line);
+  else if (strcmp (opt, "per_source") == 0)
+    option_number (opt, value, &sep->se_persource, file, line);
+  else if (strcmp (opt, "listeners") == 0)
+    {
+#ifdef SO_REUSEPORT
+      option_number (opt, value, &sep->se_listeners, file, line);
+#else
+      syslog (LOG_WARNING, "%s:%lu: option %s is not supported",
+	      file, (unsigned long) line, opt);
+#endif
+    }
+  else if (strcmp (opt, "backlog") == 0)
+    option_number (opt, value, &sep->se_backlog, file, line);
+  else if (strcmp (opt, "defer_accept") == 0)
+    {
+#ifdef TCP_DEFER_ACCEPT
+      option_number (opt, value, &sep->se_deferaccept, file, line);
+#else
+      syslog (LOG_WARNING, "%s:%lu: option %s is not supported",
+	      file, (unsigned long) line, opt);
+#endif
+    }
+  else if (strcmp (opt, "fastopen") == 0)
+    {
+#ifdef TCP_FASTOPEN
+      option_number (opt, value, &sep->se_fastopen, file, line);
+#else
+      syslog (LOG_WARNING, "%s:%lu: option %s is not supported",
+	      file, (unsigned long) line, opt);
+#endif
+    }
+  else if (strcmp (opt, "report") == 0 && !value)
+    sep->se_report = true;
+  else
+    syslog (LOG_WARNING, "%s:%lu: unknown option (%s)",
+	    file, (unsigned long) line, opt);
+}
+
 struct servtab *
 getconfigent (FILE *fconfig, const char *file, size_t *line)
 {
@@ -1139,8 +2241,11 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
       sep->se_family = AF_INET;
 #endif
       {
-	char *p, *q;
+	char *p, *q, *opts;
 
+	opts = strchr (argv[INETD_WAIT], ',');
+	if (opts)
+	  *opts++ = 0;
 	p = strchr(argv[INETD_WAIT], '.');
 	if (p)
 	  *p++ = 0;
@@ -1160,6 +2265,14 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	      syslog (LOG_WARNING, "%s:%lu: invalid number (%s)",
 		      file, (unsigned long) *line, p);
 	  }
+	while (opts)
+	  {
+	    p = opts;
+	    opts = strchr (opts, ',');
+	    if (opts)
+	      *opts++ = 0;
+	    service_option (sep, p, file, *line);
+	  }
       }
 
       if (ISMUX (sep))
@@ -1248,23 +2361,118 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	}
 
       sep->se_argv[i] = NULL;
+
+      if (sep->se_pmax && (sep->se_bi || sep->se_wait || ISMUX (sep)
+			   || sep->se_socktype != SOCK_STREAM))
+	{
+	  syslog (LOG_WARNING, "%s:%lu: prefork needs a nowait stream server",
+		  file, (unsigned long) *line);
+	  sep->se_pmin = sep->se_pmax = 0;
+	}
+      if ((sep->se_instances || sep->se_persource)
+	  && (sep->se_wait || sep->se_pmax
+	      || sep->se_socktype != SOCK_STREAM))
+	{
+	  syslog (LOG_WARNING, "%s:%lu: limits need a nowait stream server",
+		  file, (unsigned long) *line);
+	  sep->se_instances = sep->se_persource = 0;
+	}
+      if ((sep->se_listeners || sep->se_deferaccept || sep->se_fastopen)
+	  && (ISMUX (sep) || sep->se_socktype != SOCK_STREAM
+	      || strncmp (sep->se_proto, "tcp", 3) != 0))
+	{
+	  syslog (LOG_WARNING, "%s:%lu: socket options need a tcp service",
+		  file, (unsigned long) *line);
+	  sep->se_listeners = sep->se_deferaccept = sep->se_fastopen = 0;
+	}
+      /* Each listener is a service of its own, with its own counts,
+	 which would multiply the limits and pools.  */
+      if (sep->se_listeners > 1
+	  && (sep->se_pmax || sep->se_instances || sep->se_persource))
+	{
+	  syslog (LOG_WARNING,
+		  "%s:%lu: listeners cannot be used with prefork or limits",
+		  file, (unsigned long) *line);
+	  sep->se_listeners = 0;
+	}
       break;
     }
   argcv_free (argc, argv);
   return next_node_sep (sep);
 }
 
+/*
+ * Look up and record in SEP the credentials its server runs with, so
+ * that children need not look them up after every fork.  Return -1 if
+ * the user or the group is unknown.
+ */
+int
+set_credentials (struct servtab *sep)
+{
+  struct passwd *pwd;
+  struct group *grp = NULL;
+
+  pwd = getpwnam (sep->se_user);
+  if (pwd == NULL)
+    {
+      syslog (LOG_ERR, "%s/%s: No such user '%s', service ignored",
+	      sep->se_service, sep->se_proto, sep->se_user);
+      return -1;
+    }
+  if (sep->se_group && *sep->se_group)
+    {
+      grp = getgrnam (sep->se_group);
+      if (grp == NULL)
+	{
+	  syslog (LOG_ERR, "%s/%s: No such group '%s', service ignored",
+		  sep->se_service, sep->se_proto, sep->se_group);
+	  return -1;
+	}
+    }
+
+  sep->se_uid = pwd->pw_uid;
+  sep->se_gid = (grp && grp->gr_gid) ? grp->gr_gid : pwd->pw_gid;
+
+  free (sep->se_groups);
+  sep->se_groups = NULL;
+  sep->se_ngroups = 0;
+#ifdef HAVE_GETGROUPLIST
+  if (sep->se_uid)
+    {
+      int n = 16;
+
+      for (;;)
+	{
+	  gid_t *groups = realloc (sep->se_groups, n * sizeof (*groups));
+	  int want = n;
+
+	  if (!groups)
+	    {
+	      syslog (LOG_ERR, "Out of memory.");
+	      exit (-1);
+	    }
+	  sep->se_groups = groups;
+	  if (getgrouplist (pwd->pw_name, sep->se_gid, groups, &want) >= 0)
+	    {
+	      sep->se_ngroups = want;
+	      break;
+	    }
+	  n = want > n ? want : 2 * n;
+	}
+    }
+#endif
+  return 0;
+}
+
 void
-nextconfig (const char *file)
+nextconfig (struct conffile *cf)
 {
+  const char *file = cf->cf_path;
 #ifndef IPV6
   struct servent *sp;
 #endif
-  struct servtab *sep, **sepp;
-  struct passwd *pwd;
-  struct group *grp;
+  struct servtab *sep;
   FILE *fconfig;
-  SIGSTATUS sigstatus;
 
   size_t line = 0;
 
@@ -1272,35 +2480,28 @@ nextconfig (const char *file)
   if (!fconfig)
     {
       syslog (LOG_ERR, "%s: %m", file);
+      cf->cf_retry = true;
       return;
     }
   while ((sep = getconfigent (fconfig, file, &line)))
     {
-      pwd = getpwnam (sep->se_user);
-      if (pwd == NULL)
+      /* Entries dropped for reasons that may go away, such as an
+	 unknown user or a failed name lookup, make the file read
+	 again on the next SIGHUP even if it is unchanged.  */
+      if (set_credentials (sep))
 	{
-	  syslog (LOG_ERR, "%s/%s: No such user '%s', service ignored",
-		  sep->se_service, sep->se_proto, sep->se_user);
+	  cf->cf_retry = true;
 	  continue;
 	}
-      if (sep->se_group && *sep->se_group)
-	{
-	  grp = getgrnam (sep->se_group);
-	  if (grp == NULL)
-	    {
-	      syslog (LOG_ERR, "%s/%s: No such group '%s', service ignored",
-		      sep->se_service, sep->se_proto, sep->se_group);
-	      continue;
-	    }
-	}
+      sep->se_cf = cf;
       if (ISMUX (sep))
 	{
 	  sep->se_fd = -1;
 	  sep->se_checked = 1;
 	  enter (sep);
 	}
-      else
-	expand_enter (sep);
+      else if (expand_enter (sep))
+	cf->cf_retry = true;
 
       if (serv_node)
 	free (sep->se_node);
@@ -1308,9 +2509,17 @@ nextconfig (const char *file)
 	freeconfig (sep);
     }
   endconfig (fconfig);
-  /*
-   * Purge anything not looked at above.
-   */
+}
+
+/*
+ * Remove the services not looked at while reading the configuration.
+ */
+void
+purge_services (void)
+{
+  struct servtab *sep, **sepp;
+  SIGSTATUS sigstatus;
+
   signal_block (&sigstatus);
   sepp = &servtab;
   while ((sep = *sepp))
@@ -1321,10 +2530,12 @@ nextconfig (const char *file)
 	  continue;
 	}
       *sepp = sep->se_next;
+      servhash_remove (sep);
       if (sep->se_fd >= 0)
 	close_sep (sep);
       if (debug)
 	print_service ("FREE", sep);
+      child_forget (sep);
       freeconfig (sep);
       free (sep);
     }
@@ -1396,6 +2607,92 @@ fix_tcpmux (void)
     }
 }
 
+#define CONFFILE_HASH 509
+struct conffile *conffiles[CONFFILE_HASH];
+
+/*
+ * Note the file PATH, of status ST, as found while reading the
+ * configuration, and read it if it is new or has changed.
+ */
+void
+readconfig (const char *path, struct stat *st)
+{
+  struct conffile *cf, **bucket;
+  struct timespec mtime, ctime;
+
+  mtime.tv_sec = st->st_mtime;
+  ctime.tv_sec = st->st_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  mtime.tv_nsec = st->st_mtim.tv_nsec;
+  ctime.tv_nsec = st->st_ctim.tv_nsec;
+#else
+  mtime.tv_nsec = ctime.tv_nsec = 0;
+#endif
+
+  bucket = &conffiles[strhash (0, path) % CONFFILE_HASH];
+  for (cf = *bucket; cf; cf = cf->cf_next)
+    if (strcmp (cf->cf_path, path) == 0)
+      break;
+  if (!cf)
+    {
+      cf = calloc (1, sizeof (*cf));
+      if (!cf)
+	{
+	  syslog (LOG_ERR, "Out of memory.");
+	  return;
+	}
+      cf->cf_path = newstr (path);
+      cf->cf_next = *bucket;
+      *bucket = cf;
+    }
+  else if (!reread_all && !cf->cf_retry
+	   && cf->cf_dev == st->st_dev && cf->cf_ino == st->st_ino
+	   && cf->cf_size == st->st_size
+	   && cf->cf_mtime.tv_sec == mtime.tv_sec
+	   && cf->cf_mtime.tv_nsec == mtime.tv_nsec
+	   && cf->cf_ctime.tv_sec == ctime.tv_sec
+	   && cf->cf_ctime.tv_nsec == ctime.tv_nsec)
+    {
+      cf->cf_seen = cf->cf_same = true;
+      return;
+    }
+
+  cf->cf_dev = st->st_dev;
+  cf->cf_ino = st->st_ino;
+  cf->cf_size = st->st_size;
+  cf->cf_mtime = mtime;
+  cf->cf_ctime = ctime;
+  cf->cf_seen = true;
+  cf->cf_same = false;
+  cf->cf_retry = false;
+  nextconfig (cf);
+}
+
+/*
+ * Forget the files not found by this reading, once no service refers
+ * to them, and prepare for the next one.
+ */
+void
+sweep_conffiles (void)
+{
+  struct conffile *cf, **cfp;
+  int i;
+
+  for (i = 0; i < CONFFILE_HASH; i++)
+    for (cfp = &conffiles[i]; (cf = *cfp);)
+      {
+	if (cf->cf_seen)
+	  {
+	    cf->cf_seen = cf->cf_same = false;
+	    cfp = &cf->cf_next;
+	    continue;
+	  }
+	*cfp = cf->cf_next;
+	free (cf->cf_path);
+	free (cf);
+      }
+}
+
 void
 config (int signo)
 {
@@ -1431,7 +2728,7 @@ config (int signo)
 			  if (stat (path, &stats) == 0
 			      && S_ISREG (stats.st_mode))
 			    {
-			      nextconfig (path);
+			      readconfig (path, &stats);
 			    }
 			  free (path);
 			}
@@ -1441,7 +2738,7 @@ config (int signo)
 	    }
 	  else if (S_ISREG (statbuf.st_mode))
 	    {
-	      nextconfig (config_files[i]);
+	      readconfig (config_files[i], &statbuf);
 	    }
 	}
       else
@@ -1457,8 +2754,33 @@ config (int signo)
   free (linebuf);
   linebuf = NULL;
   linebufsize = 0;
+  flush_aicache ();
+
+  /* Keep the services of unchanged files, with their credentials
+     looked up again.  */
+  for (sep = servtab; sep; sep = sep->se_next)
+    if (sep->se_cf && sep->se_cf->cf_same)
+      {
+	uid_t uid = sep->se_uid;
+	gid_t gid = sep->se_gid;
+
+	if (set_credentials (sep))
+	  {
+	    sep->se_cf->cf_retry = true;
+	    continue;
+	  }
+	/* Workers run as the old user.  */
+	if (sep->se_pool && (sep->se_uid != uid || sep->se_gid != gid))
+	  {
+	    pool_stop (sep);
+	    pool_start (sep);
+	  }
+	sep->se_checked = 1;
+      }
 
   fix_tcpmux ();
+  purge_services ();
+  sweep_conffiles ();
 }
 
 
@@ -1505,22 +2827,85 @@ set_proc_title (char *a, int s)
  * Internet services provided internally by inetd:
  */
 #define BUFSIZE	8192
+#define BULKSIZE	65536	/* chargen and discard transfers */
+
+/* Linux drops data received with MSG_TRUNC from a stream socket
+   without copying it; elsewhere the flag does no harm.  */
+#ifdef MSG_TRUNC
+# define DISCARD_FLAGS	MSG_TRUNC
+#else
+# define DISCARD_FLAGS	0
+#endif
+
+/*
+ * Log the BYTES transferred by SEP since START, if asked to.
+ */
+void
+report_bytes (struct servtab *sep, unsigned long long bytes,
+	      struct timeval *start)
+{
+  struct timeval now;
+  double secs;
+
+  if (!sep || !sep->se_report)
+    return;
+  gettimeofday (&now, NULL);
+  secs = (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+  syslog (LOG_INFO, "%s/%s: %llu bytes in %.3f s, %.1f MB/s",
+	  sep->se_service, sep->se_proto, bytes, secs,
+	  secs > 0 ? bytes / secs / 1e6 : 0);
+}
 
 /* Echo service -- echo data back */
 void
 echo_stream (int s, struct servtab *sep)
 {
   char buffer[BUFSIZE];
+  unsigned long long bytes = 0;
+  struct timeval start;
   int i;
 
+  gettimeofday (&start, NULL);
   set_proc_title (sep->se_service, s);
   while ((i = read (s, buffer, sizeof buffer)) > 0
 	 && write (s, buffer, i) > 0)
-    ;
+    bytes += i;
+  report_bytes (sep, bytes, &start);
   exit (EXIT_SUCCESS);
 }
 
 /* Echo service -- echo data back */
+#if defined HAVE_RECVMMSG && defined HAVE_SENDMMSG
+# define DG_BATCH 16		/* datagrams echoed per wakeup */
+
+void
+echo_dg (int s, struct servtab *sep MAYBE_UNUSED)
+{
+  static char buffers[DG_BATCH][BUFSIZE];
+  struct sockaddr_storage sa[DG_BATCH];
+  struct mmsghdr msgs[DG_BATCH];
+  struct iovec iov[DG_BATCH];
+  int i, n;
+
+  memset (msgs, 0, sizeof (msgs));
+  for (i = 0; i < DG_BATCH; i++)
+    {
+      iov[i].iov_base = buffers[i];
+      iov[i].iov_len = BUFSIZE;
+      msgs[i].msg_hdr.msg_name = &sa[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof (sa[i]);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+  n = recvmmsg (s, msgs, DG_BATCH, MSG_DONTWAIT, NULL);
+  if (n <= 0)
+    return;
+  for (i = 0; i < n; i++)
+    iov[i].iov_len = msgs[i].msg_len;
+  sendmmsg (s, msgs, n, MSG_DONTWAIT);
+}
+#else
 void
 echo_dg (int s, struct servtab *sep MAYBE_UNUSED)
 {
@@ -1539,22 +2924,27 @@ echo_dg (int s, struct servtab *sep MAYBE_UNUSED)
     return;
   sendto (s, buffer, i, 0, (struct sockaddr *) &sa, sizeof sa);
 }
+#endif
 
 /* Discard service -- ignore data */
 void
 discard_stream (int s, struct servtab *sep)
 {
-  int ret;
-  char buffer[BUFSIZE];
+  static char buffer[BULKSIZE];
+  unsigned long long bytes = 0;
+  struct timeval start;
+  ssize_t ret;
 
+  gettimeofday (&start, NULL);
   set_proc_title (sep->se_service, s);
   while (1)
     {
-      while ((ret = read (s, buffer, sizeof buffer)) > 0)
-	;
+      while ((ret = recv (s, buffer, sizeof buffer, DISCARD_FLAGS)) > 0)
+	bytes += ret;
       if (ret == 0 || errno != EINTR)
 	break;
     }
+  report_bytes (sep, bytes, &start);
   exit (EXIT_SUCCESS);
 }
 
@@ -1572,50 +2962,60 @@ discard_dg (int s, struct servtab *sep MAYBE_UNUSED)
 char ring[128];
 char *endring;
 
+/* The stream of chargen repeats after PERIOD bytes, one line for each
+   character of the ring.  PATTERN holds a period and BULKSIZE bytes
+   more, so that a transfer can start at any offset.  */
+char pattern[sizeof ring * (LINESIZ + 2) + BULKSIZE];
+size_t period;
+
 void
 initring (void)
 {
-  int i;
+  size_t i, line, col;
 
   endring = ring;
 
-  for (i = 0; i <= 128; ++i)
+  for (i = 0; i < 128; ++i)
     if (isprint (i))
       *endring++ = i;
+
+  /* Line I of the stream starts at character I of the ring.  */
+  period = (endring - ring) * (LINESIZ + 2);
+  for (i = line = col = 0; i < sizeof pattern; i++)
+    {
+      if (col < LINESIZ)
+	pattern[i] = ring[(line + col) % (endring - ring)];
+      else
+	pattern[i] = col == LINESIZ ? '\r' : '\n';
+      if (++col == LINESIZ + 2)
+	{
+	  col = 0;
+	  line++;
+	}
+    }
 }
 
 /* Character generator */
 void
 chargen_stream (int s, struct servtab *sep)
 {
-  int len;
-  char *rs, text[LINESIZ + 2];
+  unsigned long long bytes = 0;
+  struct timeval start;
+  size_t off = 0;
+  ssize_t n;
 
+  gettimeofday (&start, NULL);
   set_proc_title (sep->se_service, s);
 
   if (!endring)
-    {
-      initring ();
-      rs = ring;
-    }
+    initring ();
 
-  text[LINESIZ] = '\r';
-  text[LINESIZ + 1] = '\n';
-  for (rs = ring;;)
+  while ((n = write (s, pattern + off, BULKSIZE)) > 0)
     {
-      len = endring - rs;
-      if (len >= LINESIZ)
-	memmove (text, rs, LINESIZ);
-      else
-	{
-	  memmove (text, rs, len);
-	  memmove (text + len, ring, LINESIZ - len);
-	}
-      if (++rs == endring)
-	rs = ring;
-      if (write (s, text, sizeof text) != sizeof text)
-	break;
+      bytes += n;
+      off = (off + n) % period;
     }
+  report_bytes (sep, bytes, &start);
   exit (EXIT_SUCCESS);
 }
 
@@ -1658,6 +3058,199 @@ chargen_dg (int s, struct servtab *sep MAYBE_UNUSED)
   sendto (s, text, sizeof text, 0, (struct sockaddr *) &sa, sizeof sa);
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Serving stream builtins within inetd.  Each wakeup of a connection
+ * does a bounded amount of work, so that none of them starves the
+ * others; the level triggered events bring it back for the rest.
+ */
+#define CONN_ROUNDS	16
+
+/*
+ * Poll the connection C for EVENTS.
+ */
+void
+conn_poll (struct conn *c, uint32_t events)
+{
+  struct epoll_event ev;
+
+  if (c->c_events == events)
+    return;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = events;
+  ev.data.u64 = (uintptr_t) c | CONN_TAG;
+  if (epoll_ctl (epfd, EPOLL_CTL_MOD, c->c_fd, &ev) == 0)
+    c->c_events = events;
+}
+
+void
+conn_close (struct conn *c)
+{
+  struct timeval now;
+
+  close (c->c_fd);
+  report_bytes (c->c_sep, c->c_bytes, &c->c_start);
+  if (c->c_sep)
+    {
+      gettimeofday (&now, NULL);
+      c->c_sep->se_active--;
+      c->c_sep->se_exited++;
+      c->c_sep->se_runtime += (now.tv_sec - c->c_start.tv_sec) * 1000LL
+	+ (now.tv_usec - c->c_start.tv_usec) / 1000;
+      source_release (c->c_src);
+    }
+  if (c->c_next)
+    c->c_next->c_prev = c->c_prev;
+  if (c->c_prev)
+    c->c_prev->c_next = c->c_next;
+  else
+    conns = c->c_next;
+  free (c->c_buf);
+  free (c);
+}
+
+/*
+ * Serve the connection CTRL to the builtin of SEP within inetd.
+ */
+void
+conn_start (struct servtab *sep, int ctrl, struct sockaddr *sa)
+{
+  struct epoll_event ev;
+  struct conn *c;
+
+  if (ctrl >= conn_fdmax)
+    {
+      syslog (LOG_WARNING, "%s/%s: too many open files, connection refused",
+	      sep->se_service, sep->se_proto);
+      close (ctrl);
+      return;
+    }
+
+  c = calloc (1, sizeof (*c));
+  if (!c)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      close (ctrl);
+      return;
+    }
+  c->c_fd = ctrl;
+  c->c_sep = sep;
+  c->c_bi = sep->se_bi;
+  gettimeofday (&c->c_start, NULL);
+  fcntl (ctrl, F_SETFL, O_NONBLOCK);
+  fcntl (ctrl, F_SETFD, FD_CLOEXEC);
+
+  /* Chargen only writes, the others start by reading.  */
+  c->c_events = c->c_bi->bi_conn == chargen_conn ? EPOLLOUT : EPOLLIN;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = c->c_events;
+  ev.data.u64 = (uintptr_t) c | CONN_TAG;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, ctrl, &ev) < 0)
+    {
+      syslog (LOG_ERR, "%s/%s: epoll_ctl: %m",
+	      sep->se_service, sep->se_proto);
+      close (ctrl);
+      free (c);
+      return;
+    }
+
+  c->c_next = conns;
+  if (conns)
+    conns->c_prev = c;
+  conns = c;
+  c->c_src = source_hold (sep, sa);
+  sep->se_active++;
+  sep->se_accepted++;
+}
+
+/*
+ * Handle activity on the connection C.
+ */
+void
+conn_ready (struct conn *c)
+{
+  (*c->c_bi->bi_conn) (c);
+}
+
+void
+echo_conn (struct conn *c)
+{
+  ssize_t n;
+  int i;
+
+  if (!c->c_buf && !(c->c_buf = malloc (BUFSIZE)))
+    {
+      conn_close (c);
+      return;
+    }
+
+  for (i = 0; i < CONN_ROUNDS; i++)
+    {
+      if (c->c_off < c->c_len)
+	{
+	  n = write (c->c_fd, c->c_buf + c->c_off, c->c_len - c->c_off);
+	  if (n < 0)
+	    break;
+	  c->c_off += n;
+	  c->c_bytes += n;
+	  continue;
+	}
+      n = read (c->c_fd, c->c_buf, BUFSIZE);
+      if (n <= 0)
+	break;
+      c->c_len = n;
+      c->c_off = 0;
+    }
+
+  if (i == CONN_ROUNDS)
+    return;
+  if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    conn_close (c);
+  else
+    /* Wait for the peer to read what we have, before reading more.  */
+    conn_poll (c, c->c_off < c->c_len ? EPOLLOUT : EPOLLIN);
+}
+
+void
+discard_conn (struct conn *c)
+{
+  static char buffer[BULKSIZE];
+  ssize_t n = 1;
+  int i;
+
+  for (i = 0; i < CONN_ROUNDS && n > 0; i++)
+    if ((n = recv (c->c_fd, buffer, sizeof buffer, DISCARD_FLAGS)) > 0)
+      c->c_bytes += n;
+
+  if (n == 0
+      || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    conn_close (c);
+}
+
+void
+chargen_conn (struct conn *c)
+{
+  ssize_t n;
+  int i;
+
+  if (!endring)
+    initring ();
+
+  for (i = 0; i < CONN_ROUNDS; i++)
+    {
+      n = write (c->c_fd, pattern + c->c_off, BULKSIZE);
+      if (n < 0)
+	{
+	  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    conn_close (c);
+	  return;
+	}
+      c->c_off = (c->c_off + n) % period;
+      c->c_bytes += n;
+    }
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
 /*
  * Return a machine readable date and time, in the form of the
  * number of seconds since midnight, Jan 1, 1900.  Since gettimeofday
@@ -1918,6 +3511,190 @@ prepenv (int ctrl, struct sockaddr *sa_client, socklen_t sa_len)
     syslog (LOG_WARNING, "getnameinfo: %s", gai_strerror (ret));
 }
 
+/*
+ * Run the service SEP on CTRL, which is either an accepted connection,
+ * or the socket of SEP.
+ */
+void
+start_service (struct servtab *sep, int ctrl, struct sockaddr *sa)
+{
+  SIGSTATUS sigstatus;
+  int dofork;
+  bool spawned = false;
+  pid_t pid;
+
+  signal_block (&sigstatus);
+  if (sep->se_pool)
+    {
+      pool_dispatch (sep, ctrl);
+      signal_unblock (&sigstatus);
+      close (ctrl);
+      return;
+    }
+  pid = 0;
+  dofork = (sep->se_bi == 0 || sep->se_bi->bi_fork);
+  if (dofork)
+    {
+      /* Builtins served within inetd count as forked servers.  */
+      if (sep->se_count++ == 0)
+	gettimeofday (&sep->se_time, NULL);
+      else if ((sep->se_max && sep->se_count > sep->se_max)
+	       || sep->se_count >= toomany)
+	{
+	  struct timeval now;
+
+	  gettimeofday (&now, NULL);
+	  if (now.tv_sec - sep->se_time.tv_sec > CNT_INTVL)
+	    {
+	      sep->se_time = now;
+	      sep->se_count = 1;
+	    }
+	  else
+	    {
+	      syslog (LOG_ERR,
+		      "%s/%s server failing (looping), service terminated",
+		      sep->se_service, sep->se_proto);
+	      close_sep (sep);
+	      if (! sep->se_wait && sep->se_socktype == SOCK_STREAM)
+		close (ctrl);
+	      signal_unblock (&sigstatus);
+	      if (!timingout)
+		{
+		  timingout = 1;
+		  alarm (RETRYTIME);
+		}
+	      return;
+	    }
+	}
+#ifdef HAVE_SYS_EPOLL_H
+      if (sep->se_bi && sep->se_bi->bi_conn)
+	{
+	  conn_start (sep, ctrl, sa);
+	  signal_unblock (&sigstatus);
+	  return;
+	}
+#endif
+#ifdef HAVE_POSIX_SPAWN
+      spawned = !sep->se_bi && !sep->se_uid && !debug;
+      if (spawned)
+	pid = spawn_service (sep, ctrl);
+      else
+#endif
+	pid = fork ();
+    }
+  if (pid < 0)
+    {
+      if (spawned)
+	{
+	  char buf[50];
+
+	  syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
+	  if (sep->se_socktype != SOCK_STREAM)
+	    recv (ctrl, buf, sizeof buf, MSG_DONTWAIT);
+	}
+      else
+	syslog (LOG_ERR, "fork: %m");
+      if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+	close (ctrl);
+      signal_unblock (&sigstatus);
+      if (!spawned)
+	sleep (1);
+      return;
+    }
+  sep->se_accepted++;
+  if (pid && dofork)
+    child_add (sep, pid, sa);
+  if (pid && sep->se_wait)
+    {
+      sep->se_wait = pid;
+      if (sep->se_fd >= 0)
+	unwatch_sep (sep);
+    }
+  signal_unblock (&sigstatus);
+  if (pid == 0)
+    {
+      if (debug && dofork)
+	setsid ();
+      if (dofork)
+	{
+	  signal_unblock (NULL);
+	  /* Servers executed do not inherit our descriptors, which
+	     are close-on-exec, but builtins run right here.  */
+	  if (sep->se_bi)
+	    {
+	      int sock;
+
+	      if (debug)
+		fprintf (stderr, "+ Closing from %d\n", maxsock);
+	      for (sock = maxsock; sock > 2; sock--)
+		if (sock != ctrl)
+		  close (sock);
+	    }
+	}
+      run_service (ctrl, sep);
+    }
+  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+    close (ctrl);
+}
+
+/*
+ * Handle activity on the socket of SEP.
+ */
+void
+service_ready (struct servtab *sep)
+{
+  int ctrl;
+
+  if (debug)
+    fprintf (stderr, "someone wants %s\n", sep->se_service);
+
+  if (sep->se_wait || sep->se_socktype != SOCK_STREAM)
+    {
+      start_service (sep, sep->se_fd, NULL);
+      return;
+    }
+
+  /* An edge triggered socket is drained, until accept()
+     reports that no connection is left.  */
+  do
+    {
+#ifdef IPV6
+      struct sockaddr_storage sa_client;
+#else
+      struct sockaddr_in sa_client;
+#endif
+      socklen_t len = sizeof (sa_client);
+
+      ctrl = accept (sep->se_fd, (struct sockaddr *) &sa_client, &len);
+      if (ctrl < 0)
+	{
+	  if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+	    {
+	      syslog (LOG_WARNING, "accept (for %s): %m", sep->se_service);
+	      /* Have the remaining backlog reported again.  */
+	      watch_sep (sep, 1);
+	    }
+	  return;
+	}
+      if (debug)
+	fprintf (stderr, "accept, ctrl %d\n", ctrl);
+      if (over_limits (sep, (struct sockaddr *) &sa_client))
+	{
+	  if (debug)
+	    fprintf (stderr, "%s over its limits, ctrl %d closed\n",
+		     sep->se_service, ctrl);
+	  sep->se_rejected++;
+	  close (ctrl);
+	  continue;
+	}
+      if (env_option)
+	prepenv (ctrl, (struct sockaddr *) &sa_client, len);
+
+      start_service (sep, ctrl, (struct sockaddr *) &sa_client);
+    }
+  while (EDGE_TRIGGERED && sep->se_fd >= 0 && !sep->se_wait);
+}
+
 
 
 int
@@ -1925,8 +3702,6 @@ main (int argc, char *argv[], char *envp[])
 {
   int index;
   struct servtab *sep;
-  int dofork;
-  pid_t pid;
 
   set_program_name (argv[0]);
 
@@ -1987,11 +3762,31 @@ main (int argc, char *argv[], char *envp[])
 	      strerror (errno));
   }
 
+#ifdef HAVE_SYS_EPOLL_H
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd < 0)
+    {
+      syslog (LOG_ERR, "epoll_create: %m");
+      exit (EXIT_FAILURE);
+    }
+# ifdef HAVE_SYS_RESOURCE_H
+  {
+    struct rlimit rl;
+
+    if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+	&& rl.rlim_cur < INT_MAX)
+      conn_fdmax = rl.rlim_cur > 2 * CONN_FD_RESERVE
+	? rl.rlim_cur - CONN_FD_RESERVE : rl.rlim_cur / 2;
+  }
+# endif
+#endif
+
   signal_set_handler (SIGALRM, retry);
   config (0);
   signal_set_handler (SIGHUP, config);
   signal_set_handler (SIGCHLD, reapchild);
   signal_set_handler (SIGPIPE, SIG_IGN);
+  signal_set_handler (SIGUSR2, write_stats);
 
   {
     /* space for daemons to overwrite environment for ps */
@@ -2003,10 +3798,57 @@ main (int argc, char *argv[], char *envp[])
     setenv ("inetd_dummy", dummy, 1);
   }
 
+#ifdef HAVE_SYS_EPOLL_H
+  {
+    SIGSTATUS sigstatus;
+
+    /* Signals are only taken while waiting, so that no handler runs
+       while events are handled: config() may free services.  */
+    signal_block (&sigstatus);
+    for (;;)
+      {
+	struct epoll_event events[EPOLL_EVENTS];
+	int i, n;
+
+	n = epoll_pwait (epfd, events, EPOLL_EVENTS,
+			 npools ? PREFORK_CHECK * 1000 : -1, &sigstatus);
+	pool_check ();
+	if (n < 0)
+	  {
+	    if (errno != EINTR)
+	      {
+		syslog (LOG_WARNING, "epoll_wait: %m");
+		sleep (1);
+	      }
+	    continue;
+	  }
+	for (i = 0; i < n; i++)
+	  {
+	    if (events[i].data.u64 & CONN_TAG)
+	      {
+		conn_ready ((struct conn *) (uintptr_t)
+			    (events[i].data.u64 & ~(uint64_t) CONN_TAG));
+		continue;
+	      }
+	    if (events[i].data.u64 & POOL_TAG)
+	      {
+		sep = (struct servtab *) (uintptr_t)
+		  (events[i].data.u64 & ~(uint64_t) POOL_TAG);
+		pool_drain (sep);
+		continue;
+	      }
+	    sep = events[i].data.ptr;
+	    if (sep->se_fd >= 0)
+	      service_ready (sep);
+	  }
+      }
+  }
+#else
   for (;;)
     {
-      int n, ctrl;
+      int n;
       fd_set readable;
+      struct timeval tv;
 
       if (nsock == 0)
 	{
@@ -2019,119 +3861,33 @@ main (int argc, char *argv[], char *envp[])
 	  signal_unblock (NULL);
 	}
       readable = allsock;
-      n = select (maxsock + 1, &readable, NULL, NULL, NULL);
+      tv.tv_sec = PREFORK_CHECK;
+      tv.tv_usec = 0;
+      n = select (maxsock + 1, &readable, NULL, NULL, npools ? &tv : NULL);
+      pool_check ();
       if (n <= 0)
 	{
-	  if (n < 0 && errno != EINTR)
-	    syslog (LOG_WARNING, "select: %m");
-	  sleep (1);
+	  if (n < 0)
+	    {
+	      if (errno != EINTR)
+		syslog (LOG_WARNING, "select: %m");
+	      sleep (1);
+	    }
 	  continue;
 	}
       for (sep = servtab; n && sep; sep = sep->se_next)
-	if (sep->se_fd != -1 && FD_ISSET (sep->se_fd, &readable))
-	  {
-	    n--;
-	    if (debug)
-	      fprintf (stderr, "someone wants %s\n", sep->se_service);
-	    if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-	      {
-#ifdef IPV6
-		struct sockaddr_storage sa_client;
-#else
-		struct sockaddr_in sa_client;
-#endif
-		socklen_t len = sizeof (sa_client);
-
-		ctrl = accept (sep->se_fd, (struct sockaddr *) &sa_client,
-			       &len);
-		if (debug)
-		  fprintf (stderr, "accept, ctrl %d\n", ctrl);
-		if (ctrl < 0)
-		  {
-		    if (errno != EINTR)
-		      syslog (LOG_WARNING, "accept (for %s): %m",
-			      sep->se_service);
-		    continue;
-		  }
-		if (env_option)
-		  prepenv (ctrl, (struct sockaddr *) &sa_client, len);
-	      }
-	    else
-	      ctrl = sep->se_fd;
-
-	    signal_block (NULL);
-	    pid = 0;
-	    dofork = (sep->se_bi == 0 || sep->se_bi->bi_fork);
-	    if (dofork)
-	      {
-		if (sep->se_count++ == 0)
-		  gettimeofday (&sep->se_time, NULL);
-		else if ((sep->se_max && sep->se_count > sep->se_max)
-			 || sep->se_count >= toomany)
-		  {
-		    struct timeval now;
-
-		    gettimeofday (&now, NULL);
-		    if (now.tv_sec - sep->se_time.tv_sec > CNT_INTVL)
-		      {
-			sep->se_time = now;
-			sep->se_count = 1;
-		      }
-		    else
-		      {
-			syslog (LOG_ERR,
-				"%s/%s server failing (looping), service terminated",
-				sep->se_service, sep->se_proto);
-			close_sep (sep);
-			if (! sep->se_wait && sep->se_socktype == SOCK_STREAM)
-			  close (ctrl);
-			signal_unblock (NULL);
-			if (!timingout)
-			  {
-			    timingout = 1;
-			    alarm (RETRYTIME);
-			  }
-			continue;
-		      }
-		  }
-		pid = fork ();
-	      }
-	    if (pid < 0)
-	      {
-		syslog (LOG_ERR, "fork: %m");
-		if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-		  close (ctrl);
-		signal_unblock (NULL);
-		sleep (1);
-		continue;
-	      }
-	    if (pid && sep->se_wait)
-	      {
-		sep->se_wait = pid;
-		if (sep->se_fd >= 0)
-		  {
-		    FD_CLR (sep->se_fd, &allsock);
-		    nsock--;
-		  }
-	      }
-	    signal_unblock (NULL);
-	    if (pid == 0)
-	      {
-		if (debug && dofork)
-		  setsid ();
-		if (dofork)
-		  {
-		    int sock;
-		    if (debug)
-		      fprintf (stderr, "+ Closing from %d\n", maxsock);
-		    for (sock = maxsock; sock > 2; sock--)
-		      if (sock != ctrl)
-			close (sock);
-		  }
-		run_service (ctrl, sep);
-	      }
-	    if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-	      close (ctrl);
-	  }
+	{
+	  if (sep->se_pool && FD_ISSET (sep->se_pool->p_done[0], &readable))
+	    {
+	      n--;
+	      pool_drain (sep);
+	    }
+	  if (sep->se_fd != -1 && FD_ISSET (sep->se_fd, &readable))
+	    {
+	      n--;
+	      service_ready (sep);
+	    }
+	}
     }
+#endif
 }
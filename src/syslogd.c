@@ -76,6 +76,28 @@
 #define DEFSPRI		(LOG_KERN|LOG_CRIT)
 #define TIMERINTVL	30	/* Interval for checking flush, mark.  */
 #define TTYMSGTIME      10	/* Time out passed to ttymsg.  */
+#define RECVBATCH	16	/* Datagrams drained per wakeup.  */
+#define MAXRECVBATCH	1024	/* Upper limit for the same.  */
+#define DNSCACHE_SIZE	256	/* Default number of cached host names.  */
+#define DNSCACHE_TTL	600	/* Lifetime of a cached host name.  */
+#define DNSCACHE_NEGTTL	60	/* Lifetime of a failed lookup.  */
+#define DNSCACHE_HASH	256	/* Number of hash chains in the cache.  */
+#define DNSREQ_MAX	32	/* Pending background lookups.  */
+#define PROGSEL_HASH	64	/* Hash chains of program selectors.  */
+#define RATESRC_HASH	256	/* Hash chains of rate limited senders.  */
+#define RATESRC_MAX	4096	/* Senders tracked by rate limiting.  */
+#define KMSGBUF		8192	/* Largest record of /dev/kmsg.  */
+#define PATH_BOOTID	"/proc/sys/kernel/random/boot_id"
+#define SYNCHIST	6	/* Buckets of fsync times, by decade.  */
+#define FLUSHINTVL	1	/* Default age of buffered output.  */
+#define TCPFORWPORT	"514"	/* Default port for TCP forwarding.  */
+#define TCPFORWQUEUE	65536	/* Default queue size per destination.  */
+#define TCPFORWRETRY	10	/* Seconds between connection attempts.  */
+#define SPOOLMAX	(16 * 1024 * 1024)	/* Default spool file limit.  */
+#define TCPCONNMAX	64	/* Default limit of TCP senders.  */
+#define TCPCONNBUF	8192	/* Default input buffer per sender.  */
+#define TCPBACKLOG	32	/* Backlog of TCP listeners.  */
+#define OUTQSIZE	(256 * 1024)	/* Default queue of writer threads.  */
 
 #include <sys/param.h>
 #include <sys/ioctl.h>
@@ -108,6 +130,10 @@
 
 #include <stdarg.h>
 
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
 #define SYSLOG_NAMES
 #include <syslog.h>
 #ifndef HAVE_SYSLOG_INTERNAL
@@ -155,6 +181,22 @@ char ctty[] = PATH_CONSOLE;	/* Default console to send message info.  */
 
 static int dbg_output;		/* If true, print debug output in debug mode.  */
 static int restart;		/* If 1, indicates SIGHUP was dropped.  */
+static int dump_stats;		/* If 1, SIGUSR2 asks for statistics.  */
+static int terminate;		/* Signal asking to exit, if any.  */
+static int mark_due;		/* If 1, SIGALRM asks for domark().  */
+
+/* Counters of an input.  */
+struct inputstat
+{
+  const char *is_name;		/* Socket or device.  */
+  int is_fd;
+  unsigned long is_msgs;	/* Messages received.  */
+  unsigned long is_bytes;	/* Bytes in the same.  */
+  unsigned long is_overflows;	/* Datagrams dropped by the kernel.  */
+};
+
+struct inputstat *Inputs;
+size_t nInputs;
 
 /* Unix socket family to listen.  */
 struct funix
@@ -165,6 +207,74 @@ struct funix
 
 size_t nfunix;			/* Number of unix sockets in the funix array.  */
 
+/* Receive buffer for one datagram of a batch.  */
+struct recvslot
+{
+#ifdef SO_RXQ_OVFL
+  char ctl[CMSG_SPACE (sizeof (uint32_t))];	/* Drop counter.  */
+#endif
+  char line[MAXLINE + 1];
+  struct sockaddr_storage from;
+};
+
+int RecvBatch = RECVBATCH;	/* Datagrams to drain per wakeup.  */
+struct recvslot *recvslots;	/* Array of RecvBatch buffers.  */
+#ifdef HAVE_RECVMMSG
+struct mmsghdr *recvmsgs;	/* Message headers for recvmmsg().  */
+struct iovec *recviov;		/* Scatter vectors for the same.  */
+int use_recvmmsg = 1;		/* Cleared if the kernel lacks support.  */
+#endif
+
+/* Statistics of batched reception.  */
+unsigned long RecvWakeups;	/* Wakeups that delivered datagrams.  */
+unsigned long RecvDatagrams;	/* Datagrams delivered by them.  */
+int RecvMaxBatch;		/* Largest number drained at once.  */
+
+/* Cached reverse lookup of a remote address.  */
+struct hostcache
+{
+  struct hostcache *hc_next;	/* Next in hash chain.  */
+  struct hostcache *hc_newer;	/* More recently used entry.  */
+  struct hostcache *hc_older;	/* Less recently used entry.  */
+  struct sockaddr_storage hc_addr;	/* Only family and address are used.  */
+  char *hc_name;		/* Name to log, maybe numerical.  */
+  time_t hc_expire;		/* Time when the entry turns stale.  */
+  int hc_pending;		/* Background lookup in progress.  */
+};
+
+struct hostcache *hostcache_tab[DNSCACHE_HASH];	/* Hash chains.  */
+struct hostcache *hostcache_newest;	/* Head of LRU list.  */
+struct hostcache *hostcache_oldest;	/* Tail of LRU list.  */
+int hostcache_count;		/* Entries in the cache.  */
+int DnsCacheSize = DNSCACHE_SIZE;	/* Maximal entries, 0 disables.  */
+int DnsCacheTtl = DNSCACHE_TTL;	/* Seconds a name is kept.  */
+int DnsAsync;			/* Resolve names in the background.  */
+
+#ifdef HAVE_PTHREAD_H
+/* Background lookup, shared with the resolver thread.  */
+struct dnsreq
+{
+  int r_state;			/* See below.  */
+  unsigned r_gen;		/* Cache generation of the request.  */
+  struct sockaddr_storage r_addr;
+  socklen_t r_addrlen;
+  int r_err;			/* Result of getnameinfo().  */
+  char r_name[NI_MAXHOST];
+};
+
+# define DNSREQ_FREE	0	/* Slot is unused.  */
+# define DNSREQ_QUEUED	1	/* Waiting for the resolver.  */
+# define DNSREQ_BUSY	2	/* Being resolved.  */
+# define DNSREQ_DONE	3	/* Result waits for the main loop.  */
+
+struct dnsreq dnsreq[DNSREQ_MAX];
+pthread_mutex_t dnsreq_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dnsreq_cond = PTHREAD_COND_INITIALIZER;
+#endif /* HAVE_PTHREAD_H */
+
+unsigned hostcache_gen;		/* Increased whenever the cache is flushed.  */
+int dns_pipe[2] = {-1, -1};	/* Resolver signals completion here.  */
+
 /*
  * Flags to logmsg().
  */
@@ -174,9 +284,44 @@ size_t nfunix;			/* Number of unix sockets in the funix array.  */
 #define ADDDATE		0x004	/* Add a date to the message.  */
 #define MARK		0x008	/* This message is a mark.  */
 
+/* Queue of a TCP forwarding action.  Frames in the format of RFC 6587,
+   octet counting, are kept in a ring buffer.  When it is full, further
+   frames are appended to a spool file, if one is configured, and read
+   back as the ring buffer drains.  */
+struct tcpforw
+{
+  char *t_port;			/* Service or port of the collector.  */
+  struct addrinfo *t_ai;	/* Addresses of the same, or NULL.  */
+  time_t t_resolved;		/* Time of the last lookup.  */
+  int t_fd;			/* Connection, or -1.  */
+  int t_connected;		/* Connection is established.  */
+  time_t t_retry;		/* No connection attempt before this.  */
+  char *t_buf;			/* Ring buffer of frames.  */
+  size_t t_size;		/* Capacity of the same.  */
+  size_t t_head;		/* Start of the oldest frame.  */
+  size_t t_len;			/* Bytes in the ring buffer.  */
+  size_t t_sent;		/* Bytes of the same sent on t_fd.  */
+  char *t_spool;		/* Name of spool file, or NULL.  */
+  int t_spoolfd;		/* Spool file descriptor, or -1.  */
+  off_t t_spooloff;		/* Bytes read back from spool file.  */
+  off_t t_spoollen;		/* Size of spool file.  */
+  unsigned long t_dropped;	/* Messages lost to full queues.  */
+};
+
 /* This structure represents the files that will have log copies
    printed.  */
 
+/* A message saved for the detection of duplicates.  All files that
+   logged a message share a single copy, looked up by a hash of the
+   message and its sending host.  */
+struct savedline
+{
+  int sl_refs;			/* Files referring to this copy.  */
+  unsigned sl_hash;		/* Hash of the message and host.  */
+  size_t sl_len;		/* Length of the message.  */
+  char *sl_text;		/* The message itself.  */
+};
+
 struct filed
 {
   struct filed *f_next;		/* Next in linked list.  */
@@ -196,24 +341,74 @@ struct filed
       char *f_hname;
       struct sockaddr_storage f_addr;
       socklen_t f_addrlen;
+      struct tcpforw *f_tcp;	/* State of TCP forwarding.  */
     } f_forw;			/* Forwarding address.  */
     char *f_fname;		/* Name use for Files|Pipes|TTYs.  */
   } f_un;
-  char f_prevline[MAXSVLINE];	/* Last message logged.  */
+  struct savedline *f_prevline;	/* Last message logged.  */
   char f_lasttime[16];		/* Time of last occurrence.  */
+  struct timeval f_lasttv;	/* The same, precisely.  */
+  int f_format;			/* Output format, see below.  */
   char *f_prevhost;		/* Host from which recd.  */
   char *f_progname;		/* Submitting program.  */
   int f_prognlen;		/* Length of the same.  */
   int f_prevpri;		/* Pri of f_prevline.  */
-  int f_prevlen;		/* Length of f_prevline.  */
   int f_prevcount;		/* Repetition cnt of prevline.  */
   size_t f_repeatcount;		/* Number of "repeated" msgs.  */
   int f_flags;			/* Additional flags see below.  */
+  int f_index;			/* Position in the list of files.  */
+  char *f_buf;			/* Buffered output, see --file-buffer.  */
+  size_t f_buflen;		/* Bytes in the same.  */
+  time_t f_buftime;		/* When the buffer was first written.  */
+  time_t f_synctime;		/* When the file was last synced.  */
+  int f_needsync;		/* Sync is pending.  */
+  struct outq *f_outq;		/* Writer thread, see --output-threads.  */
+  unsigned long f_msgs;		/* Messages handed to this action.  */
+  unsigned long f_bytes;	/* Bytes written or sent.  */
+  unsigned long f_errors;	/* Failed writes.  */
+  unsigned long f_dropped;	/* Messages lost to full queues.  */
+  unsigned long f_synchist[SYNCHIST];	/* Times taken by fsync().  */
 };
 
 struct filed *Files;		/* Linked list of files to log to.  */
+struct filed *OldFiles;		/* Previous list, during init().  */
 struct filed consfile;		/* Console `file'.  */
 
+/* Files without program selector, which accept a given facility
+   and priority.  Each is a NULL terminated array, in the order
+   of the list Files.  Computed by build_dispatch().  */
+struct filed **f_dispatch[LOG_NFACILITIES + 1][LOG_PRIMASK + 1];
+
+/* Files sharing the same program selector.  */
+struct progsel
+{
+  struct progsel *ps_next;	/* Next in hash chain.  */
+  const char *ps_name;		/* Selected program.  */
+  int ps_len;			/* Length of the same.  */
+  struct filed **ps_files;	/* NULL terminated, in list order.  */
+};
+
+struct progsel *progsel_tab[PROGSEL_HASH];	/* Hash chains.  */
+int progsel_maxlen;		/* Longest selected program name.  */
+
+struct filed **TcpForw;		/* Actions of type F_FORW_TCP.  */
+size_t nTcpForw;		/* Number of the same.  */
+
+/* Connection of a remote sender over TCP.  */
+struct tcpconn
+{
+  int c_fd;			/* Connection, or -1 when closed.  */
+  int c_lfd;			/* Listener which accepted it.  */
+  struct sockaddr_storage c_addr;	/* Address of the sender.  */
+  socklen_t c_addrlen;
+  char *c_buf;			/* Input not yet processed.  */
+  size_t c_len;			/* Bytes in the same.  */
+  size_t c_skip;		/* Rest of a long frame to discard.  */
+};
+
+struct tcpconn *TcpConn;	/* Connections of TCP senders.  */
+size_t nTcpConn;		/* Number of the same.  */
+
 /* Values for f_type.  */
 #define F_UNUSED	0	/* Unused entry.  */
 #define F_FILE		1	/* Regular file.  */
@@ -225,6 +420,7 @@ struct filed consfile;		/* Console `file'.  */
 #define F_FORW_SUSP	7	/* Suspended host forwarding.  */
 #define F_FORW_UNKN	8	/* Unknown host forwarding.  */
 #define F_PIPE		9	/* Named pipe.  */
+#define F_FORW_TCP	10	/* Remote machine, over TCP.  */
 
 const char *TypeNames[] = {
   "UNUSED",
@@ -236,12 +432,37 @@ const char *TypeNames[] = {
   "WALL",
   "FORW(SUSPENDED)",
   "FORW(UNKNOWN)",
-  "PIPE"
+  "PIPE",
+  "FORW(TCP)"
 };
 
 /* Flags in filed.f_flags.  */
 #define OMIT_SYNC	0x001	/* Omit fsync after printing.  */
 
+/* Values of filed.f_format, chosen by a suffix ";NAME" of the action.  */
+#define FMT_BSD		0	/* Traditional, with the time of RFC 3164.  */
+#define FMT_RFC3339	1	/* Ditto, but time stamps of RFC 3339.  */
+#define FMT_RFC5424	2	/* Syslog protocol of RFC 5424.  */
+#define FMT_JSON	3	/* One JSON object per line.  */
+
+/* Severities by the names of RFC 5424.  */
+const char *SeverityNames[] = {
+  "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+const char *FormatNames[] = {
+  "RFC3164",
+  "RFC3339",
+  "RFC5424",
+  "JSON",
+  NULL
+};
+
+/* Arguments to flush_files().  */
+#define FLUSH_DUE	0x000	/* Buffers and syncs whose time has come.  */
+#define FLUSH_ALL	0x001	/* Every buffer.  */
+#define FLUSH_SYNC	0x002	/* Every pending sync.  */
+
 /* Constants for the F_FORW_UNKN retry feature.  */
 #define INET_SUSPEND_TIME 180	/* Number of seconds between attempts.  */
 #define INET_RETRY_MAX	10	/* Number of times to try gethostbyname().  */
@@ -269,6 +490,7 @@ int decode (const char *, CODE *);
 void die (int);
 void doexit (int);
 void domark (int);
+void trigger_mark (int);
 void find_inet_port (const char *);
 void fprintlog (struct filed *, const char *, int, const char *);
 static int load_conffile (const char *, struct filed **);
@@ -285,9 +507,56 @@ char *textpri (int pri);
 void dbg_toggle (int);
 static void dbg_printf (const char *, ...);
 void trigger_restart (int);
+void trigger_stats (int);
+void trigger_die (int);
 static void add_funix (const char *path);
 static int create_unix_socket (const char *path);
-static void create_inet_socket (int af, int fd46[2]);
+static void create_inet_socket (int af, int socktype, const char *port,
+				int fd46[2]);
+static void tcp_accept (int);
+static size_t tcp_pollfds (struct pollfd *);
+static void tcp_input (struct tcpconn *);
+static void tcp_reap (void);
+static void alloc_recv_batch (void);
+static unsigned hash_bytes (const void *, size_t);
+static void release_savedline (struct savedline *);
+static int format_line (struct filed *, const char *, size_t,
+			char *, size_t, int);
+static int forward_line (struct filed *, struct iovec *, char *);
+static size_t split_tag (const char *, size_t, const char **, size_t *,
+			 const char **, size_t *);
+static int ratelimit (const char *, const char *);
+static void add_input (int, const char *, int);
+static struct inputstat *find_input (int);
+static int fsync_timed (int);
+static void write_stats (void);
+#ifdef PATH_KMSG
+static void kmsg_resume (void);
+static int kmsg_read (void);
+#endif
+static void ratelimit_sweep (int);
+static const char *bsd_time (time_t);
+static int recv_batch (int fd, int inet);
+static void hostcache_flush (void);
+static void build_dispatch (void);
+static void free_dispatch (void);
+static size_t match_progsel (const char *, int, int, struct filed ***);
+static int filebuf_add (struct filed *, struct iovec *, int);
+static void filebuf_flush (struct filed *, int);
+static void flush_files (int);
+static int outq_start (struct filed *);
+static int outq_put (struct filed *, struct iovec *, int, int);
+static void outq_stop (struct filed *);
+static void outq_stats (void);
+static size_t outq_counters (struct filed *, unsigned long *,
+			     unsigned long *);
+static struct tcpforw *tcpforw_new (const char *, const char *);
+static void tcpforw_free (struct filed *);
+static int tcpforw_queue (struct filed *, const char *, size_t);
+static size_t tcpforw_pollfds (struct pollfd *, time_t *);
+static void tcpforw_event (struct filed *, int);
+static int start_resolver (void);
+static void collect_resolver (void);
 
 char *LocalHostName;		/* Our hostname.  */
 char *LocalDomain;		/* Our local domain name.  */
@@ -304,6 +573,7 @@ int usefamily = AF_INET;	/* Address family for INET services.
 				 * Each of the values `AF_INET' and `AF_INET6'
 				 * produces a single-stacked server.  */
 int finet[2] = {-1, -1};	/* Internet datagram socket fd.  */
+int ftcp[2] = {-1, -1};		/* Internet stream listener fd.  */
 #define IU_FD_IP4	0	/* Indices for the address families.  */
 #define IU_FD_IP6	1
 int fklog = -1;			/* Kernel log device fd.  */
@@ -321,12 +591,56 @@ int NoDetach;			/* Don't run in background and detach
 				   from ctty. */
 int NoHops = 1;			/* Bounce syslog messages for other hosts.  */
 int NoKLog;			/* Don't attempt to log kernel device.  */
+#ifdef PATH_KMSG
+int UseKmsg;			/* FKLOG is PATH_KMSG.  */
+const char *KmsgState = PATH_KMSGSEQ;	/* Last sequence number read.  */
+int kmsg_statefd = -1;		/* The same, opened.  */
+char kmsg_bootid[40];		/* Boot id, telling sequences apart.  */
+unsigned long long KmsgSeq;	/* Sequence number of the last record.  */
+int KmsgSeqValid;		/* KmsgSeq is known.  */
+#endif
 int NoUnixAF;			/* Don't listen to unix sockets. */
 int NoForward;			/* Don't forward messages.  */
 time_t now;			/* Time use for mark and forward supending.  */
 int force_sync;			/* GNU/Linux behaviour to sync on every line.
 				   This off by default. Set to 1 to enable.  */
 int set_local_time = 0;		/* Record local time, not message time.  */
+size_t FileBufSize;		/* Output buffer per file, 0 disables.  */
+int FlushInterval = FLUSHINTVL;	/* Seconds before buffers are written.  */
+int SyncInterval;		/* Seconds between syncs of a file.  */
+time_t FlushDue;		/* Next time flush_files() has work.  */
+size_t TcpQueueSize = TCPFORWQUEUE;	/* Ring buffer per TCP forward.  */
+char *SpoolDir;			/* Spool directory for TCP forwards.  */
+off_t SpoolMax = SPOOLMAX;	/* Limit of each spool file.  */
+char *TcpPort;			/* Port to receive TCP messages on.  */
+size_t TcpConnMax = TCPCONNMAX;	/* Limit of TCP connections.  */
+size_t TcpConnBuf = TCPCONNBUF;	/* Input buffer of each connection.  */
+int OutputThreads;		/* Write files in separate threads.  */
+size_t OutputQueue = OUTQSIZE;	/* Queue of each writer thread.  */
+int OutputFormat = FMT_BSD;	/* Format of actions without one.  */
+const char *StatsFile = PATH_LOGSTATS;	/* Written on SIGUSR2.  */
+
+/* Token bucket of a sender, see ratelimit().  */
+struct ratesrc
+{
+  struct ratesrc *rs_next;	/* Hash chain.  */
+  char *rs_key;			/* Host name, or tag of a local sender.  */
+  double rs_tokens;		/* Messages that may pass now.  */
+  struct timeval rs_last;	/* When the tokens were last refilled.  */
+  unsigned long rs_suppressed;	/* Messages dropped since the last report.  */
+  unsigned long rs_dropped;	/* Messages dropped in total.  */
+};
+
+struct ratesrc *ratesrc_tab[RATESRC_HASH];
+size_t ratesrc_count;
+
+/* Shared bucket of the senders beyond RATESRC_MAX, so that a sender
+   cannot escape the limit by changing its tag or process id.  */
+char ratesrc_other_key[] = "other senders";
+struct ratesrc ratesrc_other = { NULL, ratesrc_other_key, 0, {0, 0}, 0, 0 };
+int RateInterval;		/* Seconds of the rate limit, or 0.  */
+int RateBurst;			/* Messages allowed in RateInterval.  */
+unsigned long RateDropped;	/* Messages dropped by rate limiting.  */
 
 const char args_doc[] = "";
 const char doc[] = "Log system messages.";
@@ -335,8 +649,26 @@ const char doc[] = "Log system messages.";
 enum {
   OPT_NO_FORWARD = 256,
   OPT_NO_KLOG,
+  OPT_KMSG_STATE,
   OPT_NO_UNIXAF,
-  OPT_IPANY
+  OPT_IPANY,
+  OPT_RECV_BATCH,
+  OPT_DNS_CACHE,
+  OPT_DNS_TTL,
+  OPT_DNS_ASYNC,
+  OPT_FILE_BUFFER,
+  OPT_FLUSH_INTERVAL,
+  OPT_SYNC_INTERVAL,
+  OPT_FORWARD_QUEUE,
+  OPT_FORWARD_SPOOL,
+  OPT_FORWARD_SPOOL_SIZE,
+  OPT_TCP_PORT,
+  OPT_TCP_MAX_CONN,
+  OPT_TCP_BUFFER,
+  OPT_OUTPUT_THREADS,
+  OPT_OUTPUT_QUEUE,
+  OPT_OUTPUT_FORMAT,
+  OPT_STATS_FILE
 };
 
 static struct argp_option argp_options[] = {
@@ -361,7 +693,12 @@ static struct argp_option argp_options[] = {
   {"no-detach", 'n', NULL, 0, "do not enter daemon mode", GRP+1},
   {"no-forward", OPT_NO_FORWARD, NULL, 0, "do not forward any messages "
    "(overrides --hop)", GRP+1},
-#ifdef PATH_KLOG
+#ifdef PATH_KMSG
+  {"no-klog", OPT_NO_KLOG, NULL, 0, "do not listen to kernel log device "
+   PATH_KMSG, GRP+1},
+  {"kmsg-state", OPT_KMSG_STATE, "FILE", 0, "remember the last kernel "
+   "message read in FILE (default " PATH_KMSGSEQ ")", GRP+1},
+#elif defined PATH_KLOG
   {"no-klog", OPT_NO_KLOG, NULL, 0, "do not listen to kernel log device "
    PATH_KLOG, GRP+1},
 #endif
@@ -378,6 +715,44 @@ static struct argp_option argp_options[] = {
    GRP+1},
   {"sync", 'S', NULL, 0, "force a file sync on every line", GRP+1},
   {"local-time", 'T', NULL, 0, "set local time on received messages", GRP+1},
+  {"recv-batch", OPT_RECV_BATCH, "N", 0, "receive up to N datagrams per "
+   "wakeup of a socket (default 16)", GRP+1},
+  {"dns-cache", OPT_DNS_CACHE, "N", 0, "cache up to N host names of "
+   "remote senders, 0 disables (default 256)", GRP+1},
+  {"dns-ttl", OPT_DNS_TTL, "SECS", 0, "keep cached host names for SECS "
+   "seconds (default 600)", GRP+1},
+#ifdef HAVE_PTHREAD_H
+  {"dns-async", OPT_DNS_ASYNC, NULL, 0, "resolve host names in the "
+   "background, logging numerical addresses meanwhile", GRP+1},
+#endif
+  {"file-buffer", OPT_FILE_BUFFER, "BYTES", 0, "collect output to files "
+   "in buffers of this size, 0 disables (default)", GRP+1},
+  {"flush-interval", OPT_FLUSH_INTERVAL, "SECS", 0, "write buffered output "
+   "at the latest after SECS seconds (default 1)", GRP+1},
+  {"sync-interval", OPT_SYNC_INTERVAL, "SECS", 0, "sync buffered files "
+   "at most once every SECS seconds (default 0)", GRP+1},
+  {"forward-queue", OPT_FORWARD_QUEUE, "BYTES", 0, "queue this much for "
+   "each TCP forwarding action (default 65536)", GRP+1},
+  {"forward-spool", OPT_FORWARD_SPOOL, "DIR", 0, "spool messages for "
+   "TCP forwarding in DIR when queues are full", GRP+1},
+  {"forward-spool-size", OPT_FORWARD_SPOOL_SIZE, "BYTES", 0, "limit each "
+   "spool file to this size (default 16777216)", GRP+1},
+  {"tcp-port", OPT_TCP_PORT, "PORT", 0, "receive remote messages over TCP "
+   "at PORT", GRP+1},
+  {"tcp-max-conn", OPT_TCP_MAX_CONN, "N", 0, "accept at most N TCP "
+   "connections at a time (default 64)", GRP+1},
+  {"tcp-buffer", OPT_TCP_BUFFER, "BYTES", 0, "input buffer of each TCP "
+   "connection (default 8192)", GRP+1},
+#ifdef HAVE_PTHREAD_H
+  {"output-threads", OPT_OUTPUT_THREADS, NULL, 0, "write each log file "
+   "in a thread of its own", GRP+1},
+  {"output-queue", OPT_OUTPUT_QUEUE, "BYTES", 0, "queue up to BYTES for "
+   "each writer thread (default 262144)", GRP+1},
+#endif
+  {"output-format", OPT_OUTPUT_FORMAT, "FORMAT", 0, "default format of "
+   "actions: RFC3164, RFC3339, RFC5424 or JSON (default RFC3164)", GRP+1},
+  {"stats-file", OPT_STATS_FILE, "FILE", 0, "write statistics to FILE on "
+   "SIGUSR2 (default " PATH_LOGSTATS ")", GRP+1},
 #undef GRP
   {NULL, 0, NULL, 0, NULL, 0}
 };
@@ -454,6 +829,12 @@ parse_opt (int key, char *arg, struct argp_state *state)
       NoKLog = 1;
       break;
 
+#ifdef PATH_KMSG
+    case OPT_KMSG_STATE:
+      KmsgState = arg;
+      break;
+#endif
+
     case OPT_NO_UNIXAF:
       NoUnixAF = 1;
       break;
@@ -483,6 +864,119 @@ parse_opt (int key, char *arg, struct argp_state *state)
       set_local_time = 1;
       break;
 
+    case OPT_RECV_BATCH:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 1 || v > MAXRECVBATCH)
+        argp_error (state, "invalid batch size (`%s'), allowed 1 to %d",
+		    arg, MAXRECVBATCH);
+      RecvBatch = v;
+      break;
+
+    case OPT_DNS_CACHE:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0)
+        argp_error (state, "invalid cache size (`%s')", arg);
+      DnsCacheSize = v;
+      break;
+
+    case OPT_DNS_TTL:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0)
+        argp_error (state, "invalid lifetime (`%s')", arg);
+      DnsCacheTtl = v;
+      break;
+
+    case OPT_DNS_ASYNC:
+      DnsAsync = 1;
+      break;
+
+    case OPT_FILE_BUFFER:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0)
+        argp_error (state, "invalid buffer size (`%s')", arg);
+      FileBufSize = v;
+      break;
+
+    case OPT_FLUSH_INTERVAL:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0)
+        argp_error (state, "invalid interval (`%s')", arg);
+      FlushInterval = v;
+      break;
+
+    case OPT_SYNC_INTERVAL:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0)
+        argp_error (state, "invalid interval (`%s')", arg);
+      SyncInterval = v;
+      break;
+
+    case OPT_FORWARD_QUEUE:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 2 * MAXLINE)
+        argp_error (state, "invalid queue size (`%s'), at least %d",
+		    arg, 2 * MAXLINE);
+      TcpQueueSize = v;
+      break;
+
+    case OPT_FORWARD_SPOOL:
+      SpoolDir = arg;
+      break;
+
+    case OPT_FORWARD_SPOOL_SIZE:
+      {
+	long long ll = strtoll (arg, &endptr, 10);
+
+	if (*endptr || ll < 0)
+	  argp_error (state, "invalid spool size (`%s')", arg);
+	SpoolMax = ll;
+      }
+      break;
+
+    case OPT_TCP_PORT:
+      TcpPort = arg;
+      break;
+
+    case OPT_TCP_MAX_CONN:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 1)
+        argp_error (state, "invalid number of connections (`%s')", arg);
+      TcpConnMax = v;
+      break;
+
+    case OPT_TCP_BUFFER:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < MAXLINE + 16)
+        argp_error (state, "invalid buffer size (`%s'), at least %d",
+		    arg, MAXLINE + 16);
+      TcpConnBuf = v;
+      break;
+
+    case OPT_OUTPUT_THREADS:
+      OutputThreads = 1;
+      break;
+
+    case OPT_OUTPUT_QUEUE:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 2 * MAXLINE)
+        argp_error (state, "invalid queue size (`%s'), at least %d",
+		    arg, 2 * MAXLINE);
+      OutputQueue = v;
+      break;
+
+    case OPT_OUTPUT_FORMAT:
+      for (v = 0; FormatNames[v]; v++)
+	if (strcasecmp (arg, FormatNames[v]) == 0)
+	  break;
+      if (FormatNames[v] == NULL)
+        argp_error (state, "unknown output format (`%s')", arg);
+      OutputFormat = v;
+      break;
+
+    case OPT_STATS_FILE:
+      StatsFile = arg;
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -499,12 +993,11 @@ main (int argc, char *argv[])
   size_t i;
   FILE *fp;
   char *p;
-  char line[MAXLINE + 1];
   char kline[MAXLINE + 1];
   int kline_len = 0;
   pid_t ppid = 0;		/* We run in debug mode and didn't fork.  */
   struct pollfd *fdarray;
-  unsigned long nfds = 0;
+  unsigned long nfds = 0, fdmax;
 #ifdef HAVE_SIGACTION
   struct sigaction sa;
 #endif
@@ -587,38 +1080,67 @@ main (int argc, char *argv[])
   consfile.f_type = F_CONSOLE;
   consfile.f_un.f_fname = strdup (ctty);
 
-  signal (SIGTERM, die);
-  signal (SIGINT, NoDetach ? die : SIG_IGN);
-  signal (SIGQUIT, NoDetach ? die : SIG_IGN);
+  signal (SIGTERM, trigger_die);
+  signal (SIGINT, NoDetach ? trigger_die : SIG_IGN);
+  signal (SIGQUIT, NoDetach ? trigger_die : SIG_IGN);
+
+  /* A lost TCP connection is detected by write errors.  */
+  signal (SIGPIPE, SIG_IGN);
 
 #ifdef HAVE_SIGACTION
   /* Register repeatable actions portably!  */
   sa.sa_flags = SA_RESTART;
   sigemptyset (&sa.sa_mask);
 
-  sa.sa_handler = domark;
+  sa.sa_handler = trigger_mark;
   (void) sigaction (SIGALRM, &sa, NULL);
 
   sa.sa_handler = NoDetach ? dbg_toggle : SIG_IGN;
   (void) sigaction (SIGUSR1, &sa, NULL);
 #else /* !HAVE_SIGACTION */
-  signal (SIGALRM, domark);
+  signal (SIGALRM, trigger_mark);
   signal (SIGUSR1, NoDetach ? dbg_toggle : SIG_IGN);
 #endif
 
   alarm (TIMERINTVL);
 
-  /* We add  3 = 1(klog) + 2(inet,inet6), even if they may stay unused.  */
-  fdarray = (struct pollfd *) malloc ((nfunix + 3) * sizeof (*fdarray));
+  /* We add  6 = 1(klog) + 2(inet,inet6) + 2(tcp,tcp6) + 1(resolver),
+     even if they may stay unused.  Connections are added
+     to the end of the array as needed.  */
+  fdmax = nfunix + 6;
+  fdarray = (struct pollfd *) malloc (fdmax * sizeof (*fdarray));
   if (fdarray == NULL)
     error (EXIT_FAILURE, errno, "can't allocate fd table");
 
+  /* Buffers for draining the sockets in batches.  */
+  alloc_recv_batch ();
+
   /* read configuration file */
   init (0);
 
+#ifdef PATH_KMSG
+  /* Prefer the structured kernel log, where it exists.  */
+  if (!NoKLog)
+    {
+      fklog = open (PATH_KMSG, O_RDONLY | O_NONBLOCK, 0);
+      if (fklog >= 0)
+	{
+	  UseKmsg = 1;
+	  kmsg_resume ();
+	  add_input (fklog, PATH_KMSG, 0);
+	  fdarray[nfds].fd = fklog;
+	  fdarray[nfds].events = POLLIN;
+	  nfds++;
+	  dbg_printf ("Klog open %s\n", PATH_KMSG);
+	}
+      else
+	dbg_printf ("Can't open %s: %s\n", PATH_KMSG, strerror (errno));
+    }
+#endif
+
 #ifdef PATH_KLOG
   /* Initialize kernel logging and add to the list.  */
-  if (!NoKLog)
+  if (!NoKLog && fklog < 0)
     {
       fklog = open (PATH_KLOG, O_RDONLY, 0);
       if (fklog >= 0)
@@ -641,6 +1163,7 @@ main (int argc, char *argv[])
 	  funix[i].fd = create_unix_socket (funix[i].name);
 	  if (funix[i].fd >= 0)
 	    {
+	      add_input (funix[i].fd, funix[i].name, 1);
 	      fdarray[nfds].fd = funix[i].fd;
 	      fdarray[nfds].events = POLLIN | POLLPRI;
 	      nfds++;
@@ -655,10 +1178,11 @@ main (int argc, char *argv[])
   /* Initialize inet socket and add it to the list.  */
   if (AcceptRemote)
     {
-      create_inet_socket (usefamily, finet);
+      create_inet_socket (usefamily, SOCK_DGRAM, LogPortText, finet);
       if (finet[IU_FD_IP4] >= 0)
 	{
 	  /* IPv4 socket is present.  */
+	  add_input (finet[IU_FD_IP4], "udp", 1);
 	  fdarray[nfds].fd = finet[IU_FD_IP4];
 	  fdarray[nfds].events = POLLIN | POLLPRI;
 	  nfds++;
@@ -667,6 +1191,7 @@ main (int argc, char *argv[])
       if (finet[IU_FD_IP6] >= 0)
 	{
 	  /* IPv6 socket is present.  */
+	  add_input (finet[IU_FD_IP6], "udp6", 1);
 	  fdarray[nfds].fd = finet[IU_FD_IP6];
 	  fdarray[nfds].events = POLLIN | POLLPRI;
 	  nfds++;
@@ -676,6 +1201,37 @@ main (int argc, char *argv[])
 	dbg_printf ("Can't open UDP port: %s\n", strerror (errno));
     }
 
+  /* Initialize TCP listeners.  */
+  if (TcpPort)
+    {
+      create_inet_socket (usefamily, SOCK_STREAM, TcpPort, ftcp);
+      for (i = IU_FD_IP4; i <= IU_FD_IP6; i++)
+	if (ftcp[i] >= 0)
+	  {
+	    add_input (ftcp[i], i == IU_FD_IP4 ? "tcp" : "tcp6", 0);
+	    fdarray[nfds].fd = ftcp[i];
+	    fdarray[nfds].events = POLLIN;
+	    nfds++;
+	    dbg_printf ("Opened syslog TCP/IPv%c port.\n",
+			i == IU_FD_IP4 ? '4' : '6');
+	  }
+      if (ftcp[IU_FD_IP4] < 0 && ftcp[IU_FD_IP6] < 0)
+	dbg_printf ("Can't open TCP port: %s\n", strerror (errno));
+    }
+
+  /* Name lookups in the background need a cache to
+     deliver their results to.  */
+  if ((AcceptRemote || TcpPort) && DnsAsync && DnsCacheSize > 0
+      && start_resolver () == 0)
+    {
+      fdarray[nfds].fd = dns_pipe[0];
+      fdarray[nfds].events = POLLIN;
+      nfds++;
+      dbg_printf ("Started resolver thread.\n");
+    }
+  else
+    DnsAsync = 0;
+
   /* Tuck my process id away.  */
   fp = fopen (PidFile, "w");
   if (fp != NULL)
@@ -690,8 +1246,11 @@ main (int argc, char *argv[])
   /* `sa' has been cleared already.  */
   sa.sa_handler = trigger_restart;
   (void) sigaction (SIGHUP, &sa, NULL);
+  sa.sa_handler = trigger_stats;
+  (void) sigaction (SIGUSR2, &sa, NULL);
 #else /* !HAVE_SIGACTION */
   signal (SIGHUP, trigger_restart);
+  signal (SIGUSR2, trigger_stats);
 #endif
 
   if (NoDetach)
@@ -709,11 +1268,55 @@ main (int argc, char *argv[])
 
   for (;;)
     {
-      int nready;
-      nready = poll (fdarray, nfds, -1);
+      int nready, timeout = -1;
+      size_t nfwd, nconn;
+      time_t due = FlushDue;
+
+      /* Connections of forwarding actions, and of TCP senders,
+	 come last.  */
+      if (nfds + nTcpForw + nTcpConn > fdmax)
+	{
+	  fdmax = nfds + nTcpForw + nTcpConn;
+	  fdarray = xrealloc (fdarray, fdmax * sizeof (*fdarray));
+	}
+      nfwd = tcpforw_pollfds (fdarray + nfds, &due);
+      nconn = tcp_pollfds (fdarray + nfds + nfwd);
+
+      /* Wake up in time to write out buffered output,
+	 or to connect again.  */
+      if (due)
+	{
+	  time_t wait = due - time (NULL);
+
+	  timeout = (wait > 0) ? wait * 1000 : 0;
+	}
+
+      if (terminate)
+	die (terminate);
+
+      nready = poll (fdarray, nfds + nfwd + nconn, timeout);
+
+      if (terminate)
+	die (terminate);
+
+      if (mark_due)
+	{
+	  mark_due = 0;
+	  domark (0);
+	}
+
+      if (FlushDue && time (NULL) >= FlushDue)
+	flush_files (FLUSH_DUE);
+
       if (nready == 0)		/* ??  noop */
 	continue;
 
+      if (dump_stats)
+	{
+	  dump_stats = 0;
+	  write_stats ();
+	}
+
       /* Sighup was dropped.  */
       if (restart)
 	{
@@ -732,13 +1335,28 @@ main (int argc, char *argv[])
 
       /*dbg_printf ("got a message (%d)\n", nready); */
 
+      for (i = 0; i < nfwd; i++)
+	if (fdarray[nfds + i].revents)
+	  tcpforw_event (TcpForw[i], fdarray[nfds + i].revents);
+
+      for (i = 0; i < nconn; i++)
+	if (fdarray[nfds + nfwd + i].revents)
+	  tcp_input (&TcpConn[i]);
+      tcp_reap ();
+
       for (i = 0; i < nfds; i++)
 	if (fdarray[i].revents & (POLLIN | POLLPRI))
 	  {
 	    int result;
-	    socklen_t len;
 	    if (fdarray[i].fd == -1)
 	      continue;
+#ifdef PATH_KMSG
+	    else if (fdarray[i].fd == fklog && UseKmsg)
+	      {
+		if (kmsg_read () < 0)
+		  fdarray[i].fd = fklog = -1;
+	      }
+#endif
 	    else if (fdarray[i].fd == fklog)
 	      {
 		result = read (fdarray[i].fd, &kline[kline_len],
@@ -817,37 +1435,21 @@ main (int argc, char *argv[])
 		      }
 		  }
 	      }
+	    else if (fdarray[i].fd == dns_pipe[0])
+	      collect_resolver ();
+	    else if (fdarray[i].fd == ftcp[IU_FD_IP4]
+		     || fdarray[i].fd == ftcp[IU_FD_IP6])
+	      tcp_accept (fdarray[i].fd);
 	    else if (fdarray[i].fd == finet[IU_FD_IP4]
 		     || fdarray[i].fd == finet[IU_FD_IP6])
 	      {
-		struct sockaddr_storage frominet;
 		/*dbg_printf ("inet message\n"); */
-		len = sizeof (frominet);
-		memset (line, '\0', sizeof (line));
-		result = recvfrom (fdarray[i].fd, line, MAXLINE, 0,
-				   (struct sockaddr *) &frominet, &len);
-		if (result > 0)
-		  {
-		    line[result] = '\0';
-		    printline (cvthname ((struct sockaddr *) &frominet, len), line);
-		  }
-		else if (result < 0 && errno != EINTR)
-		  logerror ("recvfrom inet");
+		recv_batch (fdarray[i].fd, 1);
 	      }
 	    else
 	      {
-		struct sockaddr_un fromunix;
 		/*dbg_printf ("unix message\n"); */
-		len = sizeof (fromunix);
-		result = recvfrom (fdarray[i].fd, line, MAXLINE, 0,
-				   (struct sockaddr *) &fromunix, &len);
-		if (result > 0)
-		  {
-		    line[result] = '\0';
-		    printline (LocalHostName, line);
-		  }
-		else if (result < 0 && errno != EINTR)
-		  logerror ("recvfrom unix");
+		recv_batch (fdarray[i].fd, 0);
 	      }
 	  }
 	else if (fdarray[i].revents & POLLNVAL)
@@ -878,6 +1480,199 @@ add_funix (const char *name)
   nfunix++;
 }
 
+static void
+alloc_recv_batch (void)
+{
+  recvslots = xcalloc (RecvBatch, sizeof (*recvslots));
+
+#ifdef HAVE_RECVMMSG
+  {
+    int i;
+
+    recvmsgs = xcalloc (RecvBatch, sizeof (*recvmsgs));
+    recviov = xcalloc (RecvBatch, sizeof (*recviov));
+
+    for (i = 0; i < RecvBatch; i++)
+      {
+	recviov[i].iov_base = recvslots[i].line;
+	recviov[i].iov_len = MAXLINE;
+	recvmsgs[i].msg_hdr.msg_iov = &recviov[i];
+	recvmsgs[i].msg_hdr.msg_iovlen = 1;
+	recvmsgs[i].msg_hdr.msg_name = &recvslots[i].from;
+#ifdef SO_RXQ_OVFL
+	recvmsgs[i].msg_hdr.msg_control = recvslots[i].ctl;
+#endif
+      }
+  }
+#endif /* HAVE_RECVMMSG */
+}
+
+/* Drain at most RecvBatch datagrams from the socket FD, which has
+   been reported readable.  Messages from an internet socket, as
+   indicated by INET, are attributed to the sending host, all others
+   to the local host.  Return the number of datagrams received.  */
+static int
+recv_batch (int fd, int inet)
+{
+  struct recvslot *slot;
+  struct inputstat *is = find_input (fd);
+  socklen_t len;
+  int n = 0, result;
+
+#ifdef HAVE_RECVMMSG
+  if (use_recvmmsg)
+    {
+      int i;
+
+      for (i = 0; i < RecvBatch; i++)
+	{
+	  recvmsgs[i].msg_hdr.msg_namelen = sizeof (recvslots[i].from);
+#ifdef SO_RXQ_OVFL
+	  recvmsgs[i].msg_hdr.msg_controllen = sizeof (recvslots[i].ctl);
+#endif
+	}
+
+      n = recvmmsg (fd, recvmsgs, RecvBatch, MSG_DONTWAIT, NULL);
+      if (n < 0 && errno == ENOSYS)
+	{
+	  dbg_printf ("recvmmsg() is not supported, using recvfrom().\n");
+	  use_recvmmsg = 0;
+	  n = 0;
+	}
+      else if (n < 0)
+	{
+	  if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+	    logerror (inet ? "recvmmsg inet" : "recvmmsg unix");
+	  return 0;
+	}
+
+      for (i = 0; i < n; i++)
+	{
+	  slot = &recvslots[i];
+	  result = recvmsgs[i].msg_len;
+	  if (result <= 0)
+	    continue;
+	  if (is)
+	    {
+#ifdef SO_RXQ_OVFL
+	      struct cmsghdr *cmsg;
+
+	      /* The kernel reports a running count of drops.  */
+	      for (cmsg = CMSG_FIRSTHDR (&recvmsgs[i].msg_hdr); cmsg;
+		   cmsg = CMSG_NXTHDR (&recvmsgs[i].msg_hdr, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET
+		    && cmsg->cmsg_type == SO_RXQ_OVFL)
+		  {
+		    uint32_t drops;
+
+		    memcpy (&drops, CMSG_DATA (cmsg), sizeof (drops));
+		    is->is_overflows = drops;
+		  }
+#endif
+	      is->is_msgs++;
+	      is->is_bytes += result;
+	    }
+
+	  slot->line[result] = '\0';
+	  if (inet)
+	    printline (cvthname ((struct sockaddr *) &slot->from,
+				 recvmsgs[i].msg_hdr.msg_namelen),
+		       slot->line);
+	  else
+	    printline (LocalHostName, slot->line);
+	}
+    }
+
+  if (!use_recvmmsg)
+#endif /* HAVE_RECVMMSG */
+    {
+      /* Only the first call may block, should the datagram have
+	 vanished after poll() reported it.  Without MSG_DONTWAIT
+	 no more than that call can be made safely.  */
+      slot = &recvslots[0];
+      for (n = 0; n < RecvBatch; n++)
+	{
+	  int flags = 0;
+
+#ifdef MSG_DONTWAIT
+	  if (n > 0)
+	    flags = MSG_DONTWAIT;
+#else
+	  if (n > 0)
+	    break;
+#endif
+	  len = sizeof (slot->from);
+	  result = recvfrom (fd, slot->line, MAXLINE, flags,
+			     (struct sockaddr *) &slot->from, &len);
+	  if (result < 0)
+	    {
+	      if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+		logerror (inet ? "recvfrom inet" : "recvfrom unix");
+	      break;
+	    }
+	  if (result == 0)
+	    continue;
+	  if (is)
+	    {
+	      is->is_msgs++;
+	      is->is_bytes += result;
+	    }
+
+	  slot->line[result] = '\0';
+	  if (inet)
+	    printline (cvthname ((struct sockaddr *) &slot->from, len),
+		       slot->line);
+	  else
+	    printline (LocalHostName, slot->line);
+	}
+    }
+
+  if (n > 0)
+    {
+      RecvWakeups++;
+      RecvDatagrams += n;
+      if (n > RecvMaxBatch)
+	RecvMaxBatch = n;
+    }
+
+  return n;
+}
+
+/* Keep counters for the input FD called NAME.  For a datagram
+   socket, as told by DGRAM, ask the kernel to report drops.  */
+static void
+add_input (int fd, const char *name, int dgram)
+{
+  struct inputstat *is;
+
+#ifdef SO_RXQ_OVFL
+  if (dgram)
+    {
+      int on = 1;
+
+      setsockopt (fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof (on));
+    }
+#endif
+
+  Inputs = xrealloc (Inputs, (nInputs + 1) * sizeof (*Inputs));
+  is = &Inputs[nInputs++];
+  memset (is, 0, sizeof (*is));
+  is->is_fd = fd;
+  is->is_name = name;
+}
+
+/* Return the counters of the input FD, or NULL.  */
+static struct inputstat *
+find_input (int fd)
+{
+  size_t i;
+
+  for (i = 0; i < nInputs; i++)
+    if (Inputs[i].is_fd == fd)
+      return &Inputs[i];
+  return NULL;
+}
+
 static int
 create_unix_socket (const char *path)
 {
@@ -913,8 +1708,10 @@ create_unix_socket (const char *path)
   return fd;
 }
 
+/* Open sockets of type SOCKTYPE at PORT, for the address family AF,
+   or for both if AF_UNSPEC.  Stream sockets are made to listen.  */
 static void
-create_inet_socket (int af, int fd46[2])
+create_inet_socket (int af, int socktype, const char *port, int fd46[2])
 {
   int err, fd = -1;
   struct addrinfo hints, *rp, *ai;
@@ -922,7 +1719,7 @@ create_inet_socket (int af, int fd46[2])
   /* Invalidate old descriptors.  */
   fd46[IU_FD_IP4] = fd46[IU_FD_IP6] = -1;
 
-  if (!LogPortText)
+  if (!port)
     {
       dbg_printf ("No listen port has been accepted.\n");
       return;
@@ -930,10 +1727,10 @@ create_inet_socket (int af, int fd46[2])
 
   memset (&hints, 0, sizeof (hints));
   hints.ai_family = af;
-  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_socktype = socktype;
   hints.ai_flags = AI_PASSIVE;
 
-  err = getaddrinfo (BindAddress, LogPortText, &hints, &rp);
+  err = getaddrinfo (BindAddress, port, &hints, &rp);
   if (err)
     {
       logerror ("lookup error, suspending inet service");
@@ -958,12 +1755,15 @@ create_inet_socket (int af, int fd46[2])
 	  (void) setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof (yes));
 	}
 
-      if (bind (fd, ai->ai_addr, ai->ai_addrlen) < 0)
+      if (bind (fd, ai->ai_addr, ai->ai_addrlen) < 0
+	  || (socktype == SOCK_STREAM && listen (fd, TCPBACKLOG) < 0))
 	{
 	  close (fd);
 	  fd = -1;
 	  continue;
 	}
+      if (socktype == SOCK_STREAM)
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
       /* Register any success.  */
       if (ai->ai_family == AF_INET && fd46[IU_FD_IP4] < 0)
 	fd46[IU_FD_IP4] = fd;
@@ -980,21 +1780,214 @@ create_inet_socket (int af, int fd46[2])
   return;
 }
 
-char **
-crunch_list (char **oldlist, char *list)
+/* Accept pending connections on the TCP listener FD.  */
+static void
+tcp_accept (int fd)
 {
-  int count, i;
-  char *p, *q;
+  for (;;)
+    {
+      struct tcpconn *c;
+      struct sockaddr_storage from;
+      socklen_t len = sizeof (from);
+      int s;
 
-  p = list;
+      s = accept (fd, (struct sockaddr *) &from, &len);
+      if (s < 0)
+	{
+	  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    logerror ("accept");
+	  return;
+	}
 
-  /* Strip off trailing delimiters.  */
-  while (p[strlen (p) - 1] == LIST_DELIMITER)
-    {
-      p[strlen (p) - 1] = '\0';
-    }
-  /* Cut off leading delimiters.  */
-  while (p[0] == LIST_DELIMITER)
+      if (nTcpConn >= TcpConnMax)
+	{
+	  dbg_printf ("Too many TCP connections, closing new one.\n");
+	  close (s);
+	  continue;
+	}
+
+      fcntl (s, F_SETFL, fcntl (s, F_GETFL) | O_NONBLOCK);
+
+      TcpConn = xrealloc (TcpConn, (nTcpConn + 1) * sizeof (*TcpConn));
+      c = &TcpConn[nTcpConn++];
+      memset (c, 0, sizeof (*c));
+      c->c_fd = s;
+      c->c_lfd = fd;
+      memcpy (&c->c_addr, &from, len);
+      c->c_addrlen = len;
+      c->c_buf = xmalloc (TcpConnBuf);
+      /* Spare the lookup of the name when it is not printed.  */
+      if (Debug)
+	dbg_printf ("Accepted TCP connection from %s.\n",
+		    cvthname ((struct sockaddr *) &from, len));
+    }
+}
+
+/* Fill in PFD for the connections of TCP senders, and return
+   their number.  */
+static size_t
+tcp_pollfds (struct pollfd *pfd)
+{
+  size_t i;
+
+  for (i = 0; i < nTcpConn; i++)
+    {
+      pfd[i].fd = TcpConn[i].c_fd;
+      pfd[i].events = POLLIN;
+      pfd[i].revents = 0;
+    }
+
+  return nTcpConn;
+}
+
+/* Log a message of LEN bytes at MSG received over C.  */
+static void
+tcp_printline (struct tcpconn *c, const char *msg, size_t len)
+{
+  struct inputstat *is = find_input (c->c_lfd);
+  char line[MAXLINE + 1];
+
+  if (is)
+    {
+      is->is_msgs++;
+      is->is_bytes += len;
+    }
+
+  /* Strip the trailer of non-transparent framing.  */
+  while (len > 0 && (msg[len - 1] == '\r' || msg[len - 1] == '\n'))
+    len--;
+  if (len == 0)
+    return;
+
+  if (len > MAXLINE)
+    len = MAXLINE;
+  memcpy (line, msg, len);
+  line[len] = '\0';
+
+  printline (cvthname ((struct sockaddr *) &c->c_addr, c->c_addrlen), line);
+}
+
+/* Read input of C, and log the complete messages in it.  A message
+   starting with a digit has octet counted framing as in RFC 6587,
+   any other is terminated by a newline.  Frames too large for the
+   buffer are truncated.  */
+static void
+tcp_input (struct tcpconn *c)
+{
+  ssize_t n;
+  char *p, *end, *nl;
+
+  n = read (c->c_fd, c->c_buf + c->c_len, TcpConnBuf - c->c_len);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+
+  if (n <= 0)
+    {
+      /* Whatever remains is the last message.  */
+      if (c->c_len > 0 && c->c_skip == 0)
+	tcp_printline (c, c->c_buf, c->c_len);
+      if (Debug)
+	dbg_printf ("Closed TCP connection from %s.\n",
+		    cvthname ((struct sockaddr *) &c->c_addr, c->c_addrlen));
+      close (c->c_fd);
+      c->c_fd = -1;
+      return;
+    }
+
+  c->c_len += n;
+  p = c->c_buf;
+  end = c->c_buf + c->c_len;
+
+  while (p < end)
+    {
+      if (c->c_skip)
+	{
+	  size_t k = MIN (c->c_skip, (size_t) (end - p));
+
+	  p += k;
+	  c->c_skip -= k;
+	  continue;
+	}
+
+      if (isdigit ((unsigned char) *p))
+	{
+	  char *q;
+	  size_t count = 0;
+
+	  for (q = p; q < end && isdigit ((unsigned char) *q)
+		 && count < TcpConnBuf; q++)
+	    count = 10 * count + (*q - '0');
+	  if (q == end)
+	    break;		/* Incomplete octet count.  */
+	  if (*q == ' ')
+	    {
+	      q++;
+	      if ((size_t) (end - q) >= count)
+		{
+		  tcp_printline (c, q, count);
+		  p = q + count;
+		  continue;
+		}
+	      if (count <= TcpConnBuf - (q - p))
+		break;		/* Wait for the rest of the frame.  */
+
+	      /* Log what fits, discard the remainder.  */
+	      tcp_printline (c, q, end - q);
+	      c->c_skip = count - (end - q);
+	      p = end;
+	      continue;
+	    }
+	  /* Not a valid count, so a line after all.  */
+	}
+
+      nl = memchr (p, '\n', end - p);
+      if (nl == NULL)
+	{
+	  if (p > c->c_buf || c->c_len < TcpConnBuf)
+	    break;		/* Wait for the newline.  */
+	  nl = end - 1;		/* The line fills the buffer.  */
+	}
+      tcp_printline (c, p, nl - p + 1);
+      p = nl + 1;
+    }
+
+  /* Keep the incomplete message.  */
+  c->c_len = end - p;
+  if (p > c->c_buf && c->c_len > 0)
+    memmove (c->c_buf, p, c->c_len);
+}
+
+/* Release the connections closed by tcp_input().  */
+static void
+tcp_reap (void)
+{
+  size_t i = 0;
+
+  while (i < nTcpConn)
+    if (TcpConn[i].c_fd < 0)
+      {
+	free (TcpConn[i].c_buf);
+	TcpConn[i] = TcpConn[--nTcpConn];
+      }
+    else
+      i++;
+}
+
+char **
+crunch_list (char **oldlist, char *list)
+{
+  int count, i;
+  char *p, *q;
+
+  p = list;
+
+  /* Strip off trailing delimiters.  */
+  while (p[strlen (p) - 1] == LIST_DELIMITER)
+    {
+      p[strlen (p) - 1] = '\0';
+    }
+  /* Cut off leading delimiters.  */
+  while (p[0] == LIST_DELIMITER)
     {
       p++;
     }
@@ -1051,6 +2044,165 @@ crunch_list (char **oldlist, char *list)
   return oldlist;
 }
 
+/* Refill the tokens of RS up to the time TV.  */
+static void
+ratesrc_refill (struct ratesrc *rs, const struct timeval *tv)
+{
+  double elapsed = (tv->tv_sec - rs->rs_last.tv_sec)
+    + (tv->tv_usec - rs->rs_last.tv_usec) / 1e6;
+
+  if (elapsed > 0)
+    {
+      rs->rs_tokens += elapsed * RateBurst / RateInterval;
+      if (rs->rs_tokens > RateBurst)
+	rs->rs_tokens = RateBurst;
+    }
+  rs->rs_last = *tv;
+}
+
+/* Log how many messages of RS were suppressed.  */
+static void
+ratesrc_report (struct ratesrc *rs)
+{
+  char buf[MAXLINE];
+
+  snprintf (buf, sizeof (buf), "syslogd: %lu messages from %s suppressed, "
+	    "%lu in total", rs->rs_suppressed, rs->rs_key, rs->rs_dropped);
+  rs->rs_suppressed = 0;
+  logmsg (LOG_SYSLOG | LOG_WARNING, buf, LocalHostName, ADDDATE);
+}
+
+/* Decide whether the message MSG received from HNAME may be logged,
+   returning zero if it exceeds the rate limit of its sender.  Remote
+   senders are told apart by host, local ones by the tag and process
+   id of the message.  Every sender has a bucket of RateBurst tokens,
+   refilled over RateInterval seconds, and each message takes one.
+   Senders beyond RATESRC_MAX share the bucket ratesrc_other.  */
+static int
+ratelimit (const char *hname, const char *msg)
+{
+  struct ratesrc *rs;
+  struct timeval tv;
+  const char *key = hname, *tag, *pid = NULL;
+  size_t keylen, taglen, pidlen, len;
+  unsigned h;
+  int pass = 1;
+
+  if (RateBurst == 0)
+    return 1;
+
+  keylen = strlen (hname);
+  if (strcmp (hname, LocalHostName) == 0)
+    {
+      len = strlen (msg);
+
+      /* Skip the time stamp, as logmsg() does.  */
+      if (len >= 16 && msg[3] == ' ' && msg[6] == ' '
+	  && msg[9] == ':' && msg[12] == ':' && msg[15] == ' ')
+	{
+	  msg += 16;
+	  len -= 16;
+	}
+      if (split_tag (msg, len, &tag, &taglen, &pid, &pidlen))
+	{
+	  key = tag;
+	  keylen = pid ? (size_t) (pid + pidlen + 1 - tag) : taglen;
+	}
+    }
+  h = hash_bytes (key, keylen) % RATESRC_HASH;
+  gettimeofday (&tv, NULL);
+
+  for (rs = ratesrc_tab[h]; rs; rs = rs->rs_next)
+    if (strncmp (rs->rs_key, key, keylen) == 0 && rs->rs_key[keylen] == '\0')
+      break;
+
+  /* Senders beyond the limit of the table share a bucket.  */
+  if (rs == NULL && ratesrc_count >= RATESRC_MAX)
+    {
+      rs = &ratesrc_other;
+      if (rs->rs_last.tv_sec == 0)
+	{
+	  rs->rs_tokens = RateBurst;
+	  rs->rs_last = tv;
+	}
+    }
+  else if (rs == NULL)
+    {
+      rs = xcalloc (1, sizeof (*rs));
+      rs->rs_key = xmalloc (keylen + 1);
+      memcpy (rs->rs_key, key, keylen);
+      rs->rs_key[keylen] = '\0';
+      rs->rs_tokens = RateBurst;
+      rs->rs_last = tv;
+      rs->rs_next = ratesrc_tab[h];
+      ratesrc_tab[h] = rs;
+      ratesrc_count++;
+    }
+
+  ratesrc_refill (rs, &tv);
+  if (rs->rs_tokens >= 1)
+    {
+      rs->rs_tokens--;
+      if (rs->rs_suppressed)
+	ratesrc_report (rs);
+    }
+  else
+    {
+      if (rs->rs_suppressed++ == 0)
+	dbg_printf ("Rate limiting %s.\n", rs->rs_key);
+      rs->rs_dropped++;
+      RateDropped++;
+      pass = 0;
+    }
+
+  return pass;
+}
+
+/* Report senders which have recovered from their rate limit, and
+   forget those which are idle.  With ALL set, report any suppressed
+   messages and empty the table.  */
+static void
+ratelimit_sweep (int all)
+{
+  struct ratesrc *rs;
+  struct timeval tv;
+  size_t i;
+
+  gettimeofday (&tv, NULL);
+
+  for (i = 0; i < RATESRC_HASH; i++)
+    {
+      struct ratesrc **prev = &ratesrc_tab[i];
+
+      while ((rs = *prev) != NULL)
+	{
+	  ratesrc_refill (rs, &tv);
+	  if (rs->rs_suppressed && (all || rs->rs_tokens >= 1))
+	    ratesrc_report (rs);
+
+	  if (all || (rs->rs_tokens >= RateBurst && !rs->rs_suppressed))
+	    {
+	      *prev = rs->rs_next;
+	      free (rs->rs_key);
+	      free (rs);
+	      ratesrc_count--;
+	    }
+	  else
+	    prev = &rs->rs_next;
+	}
+    }
+
+  /* The shared bucket starts afresh once it is idle.  */
+  rs = &ratesrc_other;
+  if (rs->rs_last.tv_sec == 0)
+    return;
+  ratesrc_refill (rs, &tv);
+  if (rs->rs_suppressed && (all || rs->rs_tokens >= 1))
+    ratesrc_report (rs);
+  if (all || (rs->rs_tokens >= RateBurst && !rs->rs_suppressed))
+    memset (&rs->rs_last, 0, sizeof (rs->rs_last));
+}
+
 /* Take a raw input line, decode the message, and print the message on
    the appropriate log files.  */
 void
@@ -1084,6 +2236,9 @@ printline (const char *hname, const char *msg)
   if (LOG_FAC (pri) == (LOG_KERN >> 3))
     pri = LOG_MAKEPRI (LOG_USER, LOG_PRI (pri));
 
+  if (!ratelimit (hname, p))
+    return;
+
   q = line;
   while ((c = *p++) != '\0' && q < &line[sizeof (line) - 1])
     if (iscntrl (c))
@@ -1148,6 +2303,150 @@ printsys (const char *msg)
     }
 }
 
+#ifdef PATH_KMSG
+/* Find where reading of PATH_KMSG left off.  The state file holds
+   the boot id and the sequence number of the last record logged,
+   the latter being valid only for the same boot.  */
+static void
+kmsg_resume (void)
+{
+  char buf[80], bootid[40];
+  unsigned long long seq;
+  int fd;
+  ssize_t n;
+
+  fd = open (PATH_BOOTID, O_RDONLY);
+  if (fd >= 0)
+    {
+      n = read (fd, kmsg_bootid, sizeof (kmsg_bootid) - 1);
+      kmsg_bootid[n > 0 ? n : 0] = '\0';
+      kmsg_bootid[strcspn (kmsg_bootid, "\n")] = '\0';
+      close (fd);
+    }
+  if (kmsg_bootid[0] == '\0')
+    strcpy (kmsg_bootid, "-");
+
+  kmsg_statefd = open (KmsgState, O_RDWR | O_CREAT, 0600);
+  if (kmsg_statefd < 0)
+    {
+      dbg_printf ("Can't open %s: %s\n", KmsgState, strerror (errno));
+      return;
+    }
+
+  n = pread (kmsg_statefd, buf, sizeof (buf) - 1, 0);
+  if (n <= 0)
+    return;
+  buf[n] = '\0';
+
+  if (sscanf (buf, "%39s %llu", bootid, &seq) == 2
+      && strcmp (bootid, kmsg_bootid) == 0)
+    {
+      KmsgSeq = seq;
+      KmsgSeqValid = 1;
+      dbg_printf ("Resuming kernel log after record %llu.\n", seq);
+    }
+}
+
+/* Record KmsgSeq in the state file.  The record has a fixed size,
+   so it is simply overwritten.  */
+static void
+kmsg_save (void)
+{
+  char buf[80];
+  int len;
+
+  if (kmsg_statefd < 0)
+    return;
+
+  len = snprintf (buf, sizeof (buf), "%-39s %20llu\n", kmsg_bootid, KmsgSeq);
+  if (pwrite (kmsg_statefd, buf, len, 0) != len)
+    dbg_printf ("Can't write %s: %s\n", KmsgState, strerror (errno));
+}
+
+/* Log the records waiting in PATH_KMSG, reading at most RecvBatch.
+   Each read returns a single record "PRI,SEQ,USEC,FLAGS;TEXT\n",
+   followed by lines of properties which are ignored.  Records up
+   to KmsgSeq are skipped, and a gap in sequence numbers is reported.
+   Return -1 if the device failed.  */
+static int
+kmsg_read (void)
+{
+  static char rec[KMSGBUF + 1];
+  struct inputstat *is = find_input (fklog);
+  char line[MAXLINE + 1];
+  int count, seen = 0;
+
+  for (count = 0; count < RecvBatch; count++)
+    {
+      unsigned long long seq, usec;
+      char *p, *text;
+      ssize_t n;
+      long pri;
+
+      n = read (fklog, rec, KMSGBUF);
+      if (n < 0)
+	{
+	  if (errno == EINTR || errno == EPIPE)
+	    continue;		/* EPIPE: Records were overwritten.  */
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    break;
+	  logerror ("klog");
+	  close (fklog);
+	  return -1;
+	}
+      if (n == 0)
+	break;
+      rec[n] = '\0';
+
+      pri = strtol (rec, &p, 10);
+      if (*p != ',')
+	continue;
+      seq = strtoull (p + 1, &p, 10);
+      if (*p != ',')
+	continue;
+      usec = strtoull (p + 1, &p, 10);
+      text = strchr (p, ';');
+      if (text == NULL)
+	continue;
+      text++;
+      text[strcspn (text, "\n")] = '\0';
+
+      if (KmsgSeqValid && seq <= KmsgSeq)
+	continue;
+      if (KmsgSeqValid && seq > KmsgSeq + 1)
+	{
+	  snprintf (line, sizeof (line),
+		    "syslogd: %llu kernel messages lost", seq - KmsgSeq - 1);
+	  logmsg (LOG_SYSLOG | LOG_WARNING, line, LocalHostName, ADDDATE);
+	}
+      KmsgSeq = seq;
+      KmsgSeqValid = 1;
+      seen = 1;
+      if (is)
+	{
+	  is->is_msgs++;
+	  is->is_bytes += n;
+	}
+
+      if (pri < 0 || pri & ~(LOG_FACMASK | LOG_PRIMASK)
+	  || LOG_FAC (pri) > LOG_NFACILITIES)
+	pri = DEFSPRI;
+
+      /* Messages written by user space carry their own tag.  */
+      if (LOG_FAC (pri) == (LOG_KERN >> 3))
+	snprintf (line, sizeof (line), "kernel: [%5llu.%06llu] %s",
+		  usec / 1000000, usec % 1000000, text);
+      else
+	snprintf (line, sizeof (line), "%s", text);
+      logmsg (pri, line, LocalHostName, SYNC_FILE | ADDDATE);
+    }
+
+  if (seen)
+    kmsg_save ();
+  return 0;
+}
+#endif /* PATH_KMSG */
+
 /* Decode a priority into textual information like auth.emerg.  */
 char *
 textpri (int pri)
@@ -1170,8 +2469,12 @@ textpri (int pri)
 void
 logmsg (int pri, const char *msg, const char *from, int flags)
 {
-  struct filed *f;
+  struct filed *f, **fv, **sel;
+  struct savedline *saved = NULL;
+  struct timeval tv;
   int fac, msglen, prilev;
+  unsigned hash = 0;
+  size_t nsel, isel = 0;
 #ifdef HAVE_SIGACTION
   sigset_t sigs, osigs;
 #else
@@ -1198,13 +2501,14 @@ logmsg (int pri, const char *msg, const char *from, int flags)
       msg[9] != ':' || msg[12] != ':' || msg[15] != ' ')
     flags |= ADDDATE;
 
-  time (&now);
+  gettimeofday (&tv, NULL);
+  now = tv.tv_sec;
   if (flags & ADDDATE)
-    timestamp = ctime (&now) + 4;
+    timestamp = bsd_time (now);
   else
     {
       if (set_local_time)
-	timestamp = ctime (&now) + 4;
+	timestamp = bsd_time (now);
       else
 	timestamp = msg;
       msg += 16;
@@ -1240,11 +2544,25 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 #endif
       return;
     }
-  for (f = Files; f; f = f->f_next)
+  /* Duplicates are recognized by the hash, computed once.  */
+  if ((flags & MARK) == 0)
+    hash = hash_bytes (msg, msglen) * 16777619U
+      ^ hash_bytes (from, strlen (from));
+
+  /* Only files accepting this priority are visited, those with
+     a program selector if it matches.  Both kinds are merged in
+     the order of the configuration.  */
+  fv = f_dispatch[fac][prilev];
+  nsel = match_progsel (msg, fac, prilev, &sel);
+
+  for (;;)
     {
-      /* Skip messages that are incorrect priority. */
-      if (!(f->f_pmask[fac] & LOG_MASK (prilev)))
-	continue;
+      if (fv && *fv && (isel >= nsel || (*fv)->f_index < sel[isel]->f_index))
+	f = *fv++;
+      else if (isel < nsel)
+	f = sel[isel++];
+      else
+	break;
 
       if (f->f_type == F_CONSOLE && (flags & IGN_CONS))
 	continue;
@@ -1253,30 +2571,16 @@ logmsg (int pri, const char *msg, const char *from, int flags)
       if ((flags & MARK) && (now - f->f_time) < MarkInterval / 2)
 	continue;
 
-      if (f->f_progname)
-	{
-	  /* The usual, and desirable, formattings are:
-	   *
-	   *   prg: message text
-	   *   prg[PIDNO]: message text
-	   */
-
-	  /* Skip on selector mismatch.  */
-	  if (strncmp (msg, f->f_progname, f->f_prognlen))
-	    continue;
-
-	  /* Avoid matching on prefixes.  */
-	  if (isalnum (msg[f->f_prognlen])
-	      || msg[f->f_prognlen] == '-'
-	      || msg[f->f_prognlen] == '_')
-	    continue;
-	}
-
       /* Suppress duplicate lines to this file.  */
-      if ((flags & MARK) == 0 && msglen == f->f_prevlen && f->f_prevhost
-	  && !strcmp (msg, f->f_prevline) && !strcmp (from, f->f_prevhost))
+      if ((flags & MARK) == 0 && f->f_prevline
+	  && f->f_prevline->sl_hash == hash
+	  && f->f_prevline->sl_len == (size_t) msglen && f->f_prevhost
+	  && !memcmp (msg, f->f_prevline->sl_text, msglen)
+	  && !strcmp (from, f->f_prevhost))
 	{
-	  strncpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
+	  memcpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
+	  f->f_lasttime[sizeof (f->f_lasttime) - 1] = '\0';
+	  f->f_lasttv = tv;
 	  f->f_prevcount++;
 	  dbg_printf ("msg repeated %d times, %ld sec of %d\n",
 		      f->f_prevcount, now - f->f_time,
@@ -1296,24 +2600,38 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 	  if (f->f_prevcount)
 	    fprintlog (f, from, 0, (char *) NULL);
 	  f->f_repeatcount = 0;
-	  strncpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
+	  memcpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
+	  f->f_lasttime[sizeof (f->f_lasttime) - 1] = '\0';
+	  f->f_lasttv = tv;
+	  f->f_prevpri = pri;
 	  free (f->f_prevhost);
 	  f->f_prevhost = strdup (from);
+	  release_savedline (f->f_prevline);
+	  f->f_prevline = NULL;
 	  if (msglen < MAXSVLINE)
 	    {
-	      f->f_prevlen = msglen;
-	      f->f_prevpri = pri;
-	      strcpy (f->f_prevline, msg);
+	      if (saved == NULL)
+		{
+		  /* This call holds a reference of its own, since
+		     fprintlog may reenter logmsg through logerror
+		     and drop those of the files.  */
+		  saved = xmalloc (sizeof (*saved) + msglen + 1);
+		  saved->sl_refs = 1;
+		  saved->sl_hash = hash;
+		  saved->sl_len = msglen;
+		  saved->sl_text = (char *) (saved + 1);
+		  memcpy (saved->sl_text, msg, msglen + 1);
+		}
+	      saved->sl_refs++;
+	      f->f_prevline = saved;
 	      fprintlog (f, from, flags, (char *) NULL);
 	    }
 	  else
-	    {
-	      f->f_prevline[0] = 0;
-	      f->f_prevlen = 0;
-	      fprintlog (f, from, flags, msg);
-	    }
+	    fprintlog (f, from, flags, msg);
 	}
     }
+  free (sel);
+  release_savedline (saved);
 #ifdef HAVE_SIGACTION
   sigprocmask (SIG_SETMASK, &osigs, 0);
 #else
@@ -1321,42 +2639,271 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 #endif
 }
 
-void
-fprintlog (struct filed *f, const char *from, int flags, const char *msg)
+/* Drop a reference to the saved message SL.  */
+static void
+release_savedline (struct savedline *sl)
 {
-  struct iovec iov[IOVCNT];
-  struct iovec *v;
-  int l;
-  char line[MAXLINE + 1], repbuf[80], greetings[200];
-  time_t fwd_suspend;
+  if (sl && --sl->sl_refs == 0)
+    free (sl);
+}
 
-  v = iov;
-  /* Be paranoid.  */
-  memset (v, 0, sizeof (struct iovec) * IOVCNT);
-  if (f->f_type == F_WALL)
+/* Return the time T as in RFC 3164, like "Oct 17 04:04:39".
+   The result is kept for the rest of the second.  */
+static const char *
+bsd_time (time_t t)
+{
+  static time_t last = -1;
+  static char buf[16];
+
+  if (t != last)
     {
-      v->iov_base = greetings;
-      snprintf (greetings, sizeof (greetings),
-		"\r\n\7Message from syslogd@%s at %.24s ...\r\n",
-		f->f_prevhost, ctime (&now));
-      v->iov_len = strlen (greetings);
-      v++;
-      v->iov_base = (char *) "";
-      v->iov_len = 0;
-      v++;
+      memcpy (buf, ctime (&t) + 4, 15);
+      buf[15] = '\0';
+      last = t;
     }
-  else
+  return buf;
+}
+
+/* Write the time TV as in RFC 3339 to BUF, which must hold at least
+   33 bytes, like "2026-10-17T04:04:39.123456+02:00".  All but the
+   fraction are computed once a second.  */
+static void
+rfc3339_time (const struct timeval *tv, char *buf)
+{
+  static time_t last = -1;
+  static char date[24], zone[8];
+
+  if (tv->tv_sec != last)
     {
-      v->iov_base = f->f_lasttime;
-      v->iov_len = sizeof (f->f_lasttime) - 1;
-      v++;
-      v->iov_base = (char *) " ";
-      v->iov_len = 1;
-      v++;
+      struct tm tm;
+      char z[8];
+
+      localtime_r (&tv->tv_sec, &tm);
+      strftime (date, sizeof (date), "%Y-%m-%dT%H:%M:%S", &tm);
+      if (strftime (z, sizeof (z), "%z", &tm) == 5)
+	snprintf (zone, sizeof (zone), "%.3s:%.2s", z, z + 3);
+      else
+	strcpy (zone, "Z");
+      last = tv->tv_sec;
     }
-  if (f->f_prevhost)
-    {
-      v->iov_base = f->f_prevhost;
+  snprintf (buf, 33, "%s.%06ld%s", date, (long) tv->tv_usec, zone);
+}
+
+/* Split the tag of the message MSG of LEN bytes, as in "prog[pid]: ".
+   Return the offset of the text after it, or zero if there is none.
+   The tag and process id are stored in TAG and PID with their
+   lengths, those are left untouched without a tag.  */
+static size_t
+split_tag (const char *msg, size_t len, const char **tag, size_t *taglen,
+	   const char **pid, size_t *pidlen)
+{
+  const char *p = msg, *end = msg + len, *q;
+  const char *xpid = NULL;
+  size_t xpidlen = 0;
+
+  while (p < end && p - msg < 48 && *p != ':' && *p != '[' && *p != ' ')
+    p++;
+  if (p == msg || p == end)
+    return 0;
+
+  q = p;
+  if (*p == '[')
+    {
+      xpid = p + 1;
+      p = memchr (xpid, ']', end - xpid);
+      if (p == NULL)
+	return 0;
+      xpidlen = p - xpid;
+      p++;
+    }
+  if (p == end || *p != ':')
+    return 0;
+  p++;
+  if (p < end && *p == ' ')
+    p++;
+
+  *tag = msg;
+  *taglen = q - msg;
+  if (xpid)
+    {
+      *pid = xpid;
+      *pidlen = xpidlen;
+    }
+  return p - msg;
+}
+
+/* Append to BUF, of SIZE bytes and with N used, as snprintf() does.
+   Return the bytes used afterwards, at most SIZE - 1.  */
+static size_t
+buf_printf (char *buf, size_t size, size_t n, const char *fmt, ...)
+{
+  va_list ap;
+  int l;
+
+  va_start (ap, fmt);
+  l = vsnprintf (buf + n, size - n, fmt, ap);
+  va_end (ap);
+
+  if (l < 0)
+    return n;
+  return n + l < size ? n + l : size - 1;
+}
+
+/* Append the LEN bytes at SRC as the contents of a JSON string to
+   BUF, of SIZE bytes and with N used.  RESERVE bytes are left free
+   for what follows.  Return the bytes used afterwards.  */
+static size_t
+json_escape (char *buf, size_t size, size_t n, size_t reserve,
+	     const char *src, size_t len)
+{
+  for (; len > 0 && n + 6 + reserve < size; src++, len--)
+    {
+      unsigned char c = *src;
+
+      if (c == '"' || c == '\\')
+	{
+	  buf[n++] = '\\';
+	  buf[n++] = c;
+	}
+      else if (c == '\t')
+	{
+	  buf[n++] = '\\';
+	  buf[n++] = 't';
+	}
+      else if (c < 0x20 || c == 0x7f)
+	n += sprintf (buf + n, "\\u%04x", c);
+      else
+	buf[n++] = c;
+    }
+  buf[n] = '\0';
+  return n;
+}
+
+/* Format the message MSG of LEN bytes for F into BUF of SIZE bytes,
+   with the current time and host of F, as the format of F asks.
+   FORW is set for a forwarding action, which gets the priority also
+   in RFC 3339 format.  Return the length of the line, which is at
+   most SIZE - 1.  */
+static int
+format_line (struct filed *f, const char *msg, size_t len,
+	     char *buf, size_t size, int forw)
+{
+  const char *host = f->f_prevhost ? f->f_prevhost : "-";
+  const char *tag = NULL, *pid = NULL;
+  size_t taglen = 0, pidlen = 0, off, n = 0;
+  char stamp[33];
+  CODE *c;
+
+  rfc3339_time (&f->f_lasttv, stamp);
+
+  switch (f->f_format)
+    {
+    case FMT_RFC5424:
+      off = split_tag (msg, len, &tag, &taglen, &pid, &pidlen);
+      n = buf_printf (buf, size, 0, "<%d>1 %s %s %.*s %.*s - - %.*s",
+		      f->f_prevpri, stamp, host,
+		      tag ? (int) taglen : 1, tag ? tag : "-",
+		      pid ? (int) pidlen : 1, pid ? pid : "-",
+		      (int) (len - off), msg + off);
+      break;
+
+    case FMT_JSON:
+      for (c = (CODE *) facilitynames; c->c_name; c++)
+	if (c->c_val == LOG_FAC (f->f_prevpri) << 3)
+	  break;
+      n = buf_printf (buf, size, n, "{\"time\":\"%s\",\"host\":\"", stamp);
+      n = json_escape (buf, size, n, 0, host, strlen (host));
+      n = buf_printf (buf, size, n,
+		      "\",\"facility\":\"%s\",\"severity\":\"%s\"",
+		      c->c_name ? c->c_name : "unknown",
+		      SeverityNames[LOG_PRI (f->f_prevpri)]);
+      off = split_tag (msg, len, &tag, &taglen, &pid, &pidlen);
+      if (off)
+	{
+	  n = buf_printf (buf, size, n, ",\"tag\":\"");
+	  n = json_escape (buf, size, n, 0, tag, taglen);
+	  if (pid)
+	    {
+	      n = buf_printf (buf, size, n, "\",\"pid\":\"");
+	      n = json_escape (buf, size, n, 0, pid, pidlen);
+	    }
+	  n = buf_printf (buf, size, n, "\"");
+	}
+      n = buf_printf (buf, size, n, ",\"msg\":\"");
+      n = json_escape (buf, size, n, 2, msg + off, len - off);
+      n = buf_printf (buf, size, n, "\"}");
+      break;
+
+    default:
+      if (forw)
+	n = buf_printf (buf, size, 0, "<%d>%s %s %.*s", f->f_prevpri,
+			stamp, host, (int) len, msg);
+      else
+	n = buf_printf (buf, size, 0, "%s %s %.*s", stamp, host,
+			(int) len, msg);
+      break;
+    }
+
+  return n;
+}
+
+/* Format the message in IOV, as prepared by fprintlog(), into LINE
+   for forwarding by F.  Return its length, at most MAXLINE.  */
+static int
+forward_line (struct filed *f, struct iovec *iov, char *line)
+{
+  int l;
+
+  if (f->f_format != FMT_BSD)
+    return format_line (f, iov[4].iov_base, iov[4].iov_len,
+			line, MAXLINE + 1, 1);
+
+  snprintf (line, MAXLINE + 1, "<%d>%.15s %s",
+	    f->f_prevpri, (char *) iov[0].iov_base,
+	    (char *) iov[4].iov_base);
+  l = strlen (line);
+  if (l > MAXLINE)
+    l = MAXLINE;
+  return l;
+}
+
+void
+fprintlog (struct filed *f, const char *from, int flags, const char *msg)
+{
+  struct iovec iov[IOVCNT];
+  struct iovec *v;
+  int l;
+  char line[MAXLINE + 1], repbuf[80], greetings[200];
+  char fmtline[2 * MAXLINE];
+  time_t fwd_suspend;
+
+  v = iov;
+  /* Be paranoid.  */
+  memset (v, 0, sizeof (struct iovec) * IOVCNT);
+  if (f->f_type == F_WALL)
+    {
+      v->iov_base = greetings;
+      snprintf (greetings, sizeof (greetings),
+		"\r\n\7Message from syslogd@%s at %.24s ...\r\n",
+		f->f_prevhost, ctime (&now));
+      v->iov_len = strlen (greetings);
+      v++;
+      v->iov_base = (char *) "";
+      v->iov_len = 0;
+      v++;
+    }
+  else
+    {
+      v->iov_base = f->f_lasttime;
+      v->iov_len = sizeof (f->f_lasttime) - 1;
+      v++;
+      v->iov_base = (char *) " ";
+      v->iov_len = 1;
+      v++;
+    }
+  if (f->f_prevhost)
+    {
+      v->iov_base = f->f_prevhost;
       v->iov_len = strlen (v->iov_base);
       v++;
     }
@@ -1376,15 +2923,23 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 		f->f_prevcount);
       v->iov_len = strlen (repbuf);
     }
+  else if (f->f_prevline)
+    {
+      v->iov_base = f->f_prevline->sl_text;
+      v->iov_len = f->f_prevline->sl_len;
+    }
   else
     {
-      v->iov_base = f->f_prevline;
-      v->iov_len = f->f_prevlen;
+      v->iov_base = (char *) "";
+      v->iov_len = 0;
     }
   v++;
 
   dbg_printf ("Logging to %s", TypeNames[f->f_type]);
 
+  if (f->f_type != F_UNUSED)
+    f->f_msgs++;
+
   switch (f->f_type)
     {
     case F_UNUSED:
@@ -1508,17 +3063,16 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	    } /* Creation of temporary outgoing socket since "finet < 0" */
 
 	  f->f_time = now;
-	  snprintf (line, sizeof (line), "<%d>%.15s %s",
-		    f->f_prevpri, (char *) iov[0].iov_base,
-		    (char *) iov[4].iov_base);
-	  l = strlen (line);
-	  if (l > MAXLINE)
-	    l = MAXLINE;
+	  l = forward_line (f, iov, line);
 	  if (sendto (temp_finet, line, l, 0,
 		      (struct sockaddr *) &f->f_un.f_forw.f_addr,
-		      f->f_un.f_forw.f_addrlen) != l)
+		      f->f_un.f_forw.f_addrlen) == l)
+	    f->f_bytes += l;
+	  else
 	    {
 	      int e = errno;
+
+	      f->f_errors++;
 	      dbg_printf ("INET sendto error: %d = %s.\n", e, strerror (e));
 	      f->f_type = F_FORW_SUSP;
 	      errno = e;
@@ -1530,6 +3084,21 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	}
       break;
 
+    case F_FORW_TCP:
+      dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
+      if (strcasecmp (from, LocalHostName) && NoHops)
+	dbg_printf ("Not forwarding remote message.\n");
+      else if (NoForward)
+	dbg_printf ("Not forwarding because forwarding is disabled.\n");
+      else
+	{
+	  f->f_time = now;
+	  l = forward_line (f, iov, line);
+	  if (tcpforw_queue (f, line, l) == 0)
+	    f->f_bytes += l;
+	}
+      break;
+
     case F_CONSOLE:
       f->f_time = now;
       if (flags & IGN_CONS)
@@ -1553,14 +3122,52 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	  v->iov_base = (char *) "\n";
 	  v->iov_len = 1;
 	}
+
+      /* Other formats are written as a whole line.  */
+      if (f->f_format != FMT_BSD)
+	{
+	  iov[0].iov_base = fmtline;
+	  iov[0].iov_len = format_line (f, iov[4].iov_base, iov[4].iov_len,
+					fmtline, sizeof (fmtline), 0);
+	  iov[1].iov_len = iov[2].iov_len = iov[3].iov_len = 0;
+	  iov[4].iov_len = 0;
+	}
+
+      /* A writer thread takes care of its file, unless it failed.
+	 Then the file is written directly, to report the error.  */
+      if (f->f_outq)
+	{
+	  int rc = outq_put (f, iov, IOVCNT, (flags & SYNC_FILE)
+			     && !(f->f_flags & OMIT_SYNC));
+
+	  if (rc > 0)
+	    f->f_dropped++;
+	  if (rc >= 0)
+	    break;
+	  outq_stop (f);
+	}
+
+      /* Buffered output is written by flush_files().  */
+      if (f->f_type == F_FILE && FileBufSize > 0
+	  && filebuf_add (f, iov, IOVCNT) == 0)
+	{
+	  if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
+	    f->f_needsync = 1;
+	  break;
+	}
     again:
-      if (writev (f->f_file, iov, IOVCNT) < 0)
+      if ((l = writev (f->f_file, iov, IOVCNT)) < 0)
 	{
 	  int e = errno;
 
 	  /* XXX: If a named pipe is full, ignore it.  */
 	  if (f->f_type == F_PIPE && e == EAGAIN)
-	    break;
+	    {
+	      f->f_dropped++;
+	      break;
+	    }
+
+	  f->f_errors++;
 
 	  close (f->f_file);
 	  /* Check for errors on TTY's due to loss of tty. */
@@ -1587,8 +3194,12 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	      f->f_un.f_fname = NULL;
 	    }
 	}
-      else if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
-	fsync (f->f_file);
+      else
+	{
+	  f->f_bytes += l;
+	  if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
+	    f->f_synchist[fsync_timed (f->f_file)]++;
+	}
       break;
 
     case F_USERS:
@@ -1605,82 +3216,1413 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
     f->f_prevcount = 0;
 }
 
-/* Write the specified message to either the entire world,
- * or to a list of approved users.  */
-void
-wallmsg (struct filed *f, struct iovec *iov)
+/* Append the message in IOV to the output buffer of F, allocating it
+   as needed.  The buffer is written out first, should the message not
+   fit.  Return -1 if the message is larger than the whole buffer, in
+   which case the caller must write it directly.  */
+static int
+filebuf_add (struct filed *f, struct iovec *iov, int iovcnt)
 {
-  static int reenter;		/* Avoid calling ourselves.  */
-  STRUCT_UTMP *utp;
-#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
-  STRUCT_UTMP *utmpbuf;
-  size_t utmp_count;
-#endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
+  size_t len = 0;
   int i;
-  char *p;
-  char line[sizeof (utp->ut_line) + 1];
 
-  if (reenter++)
-    return;
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
 
-#if !defined UTMP_NAME_FUNCTION && defined HAVE_GETUTXENT
-  setutxent ();
+  if (f->f_buflen + len > FileBufSize)
+    filebuf_flush (f, 0);
 
-  while ((utp = getutxent ()))
-#else /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
-  if (read_utmp (UTMP_FILE, &utmp_count, &utmpbuf,
-		 READ_UTMP_USER_PROCESS | READ_UTMP_CHECK_PIDS) < 0)
+  /* The flush may have failed.  */
+  if (f->f_type != F_FILE || len > FileBufSize)
+    return -1;
+
+  if (f->f_buf == NULL)
+    f->f_buf = xmalloc (FileBufSize);
+
+  if (f->f_buflen == 0)
     {
-      logerror ("opening utmp file");
-      return;
+      f->f_buftime = now;
+      if (FlushDue == 0 || now + FlushInterval < FlushDue)
+	FlushDue = now + FlushInterval;
     }
 
-  for (utp = utmpbuf; utp < utmpbuf + utmp_count; utp++)
-#endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
+  for (i = 0; i < iovcnt; i++)
     {
-      strncpy (line, utp->ut_line, sizeof (utp->ut_line));
-      line[sizeof (utp->ut_line)] = '\0';
-      if (f->f_type == F_WALL)
+      memcpy (f->f_buf + f->f_buflen, iov[i].iov_base, iov[i].iov_len);
+      f->f_buflen += iov[i].iov_len;
+    }
+  f->f_bytes += len;
+
+  return 0;
+}
+
+/* Write out the buffer of F.  A pending sync is done if SYNC is
+   set, or if SyncInterval has passed since the last one.  */
+static void
+filebuf_flush (struct filed *f, int sync)
+{
+  size_t off = 0;
+
+  while (off < f->f_buflen)
+    {
+      ssize_t n = write (f->f_file, f->f_buf + off, f->f_buflen - off);
+
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0)
 	{
-	  /* Note we're using our own version of ttymsg
-	     which does a double fork () to not have
-	     zombies.  No need to waitpid().  */
-	  p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
-	  if (p != NULL)
+	  int e = errno;
+
+	  f->f_errors++;
+	  close (f->f_file);
+	  f->f_type = F_UNUSED;
+	  f->f_buflen = 0;
+	  f->f_needsync = 0;
+	  errno = e;
+	  logerror (f->f_un.f_fname);
+	  free (f->f_un.f_fname);
+	  f->f_un.f_fname = NULL;
+	  return;
+	}
+      off += n;
+    }
+  f->f_buflen = 0;
+
+  if (f->f_needsync && (sync || now - f->f_synctime >= SyncInterval))
+    {
+      f->f_synchist[fsync_timed (f->f_file)]++;
+      f->f_synctime = now;
+      f->f_needsync = 0;
+    }
+}
+
+/* Write out buffered output.  HOW is FLUSH_DUE to handle only those
+   buffers and syncs which are due, else a combination of FLUSH_ALL
+   to write every buffer, and FLUSH_SYNC to do every pending sync.  */
+static void
+flush_files (int how)
+{
+  struct filed *f;
+
+  now = time (NULL);
+  FlushDue = 0;
+
+  for (f = Files; f; f = f->f_next)
+    {
+      time_t due;
+
+      if (f->f_type != F_FILE || (f->f_buflen == 0 && !f->f_needsync))
+	continue;
+
+      if ((how & FLUSH_ALL) || now >= f->f_buftime + FlushInterval
+	  || (f->f_needsync && now >= f->f_synctime + SyncInterval))
+	filebuf_flush (f, how & FLUSH_SYNC);
+
+      /* Remember when there is more to do.  */
+      if (f->f_type != F_FILE)
+	continue;
+      else if (f->f_buflen)
+	due = f->f_buftime + FlushInterval;
+      else if (f->f_needsync)
+	due = f->f_synctime + SyncInterval;
+      else
+	continue;
+      if (FlushDue == 0 || due < FlushDue)
+	FlushDue = due;
+    }
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Queue of a writer thread.  The main thread appends messages to
+   Q_BUF, which the writer exchanges for Q_WBUF before writing it
+   out.  A message that does not fit is dropped, so that a slow file
+   never holds up the reception of messages.  */
+struct outq
+{
+  pthread_t q_tid;
+  pthread_mutex_t q_lock;
+  pthread_cond_t q_cond;	/* Signalled when there is work.  */
+  int q_fd;			/* File to write.  */
+  char *q_buf;			/* Messages waiting.  */
+  char *q_wbuf;			/* Messages being written.  */
+  size_t q_len;			/* Bytes in Q_BUF.  */
+  int q_sync;			/* Sync is requested.  */
+  int q_stop;			/* Thread shall exit.  */
+  int q_error;			/* Errno of a failed write.  */
+  unsigned long q_msgs;		/* Messages queued.  */
+  unsigned long q_dropped;	/* Messages dropped on a full queue.  */
+  size_t q_maxlen;		/* Largest backlog seen.  */
+  unsigned long q_errors;	/* Failed writes.  */
+  unsigned long q_synchist[SYNCHIST];	/* Times taken by fsync().  */
+};
+
+/* Body of a writer thread.  */
+static void *
+writer (void *arg)
+{
+  struct outq *q = arg;
+  time_t synctime = 0;
+
+  pthread_mutex_lock (&q->q_lock);
+  for (;;)
+    {
+      char *buf;
+      size_t len, off = 0;
+      int dosync, err = 0, bucket = -1;
+
+      while (q->q_len == 0 && !q->q_stop
+	     && !(q->q_sync && time (NULL) >= synctime + SyncInterval))
+	{
+	  if (q->q_sync)
 	    {
-	      errno = 0;	/* Already in message. */
-	      logerror (p);
+	      struct timespec ts;
+
+	      ts.tv_sec = synctime + SyncInterval;
+	      ts.tv_nsec = 0;
+	      pthread_cond_timedwait (&q->q_cond, &q->q_lock, &ts);
 	    }
-	  continue;
+	  else
+	    pthread_cond_wait (&q->q_cond, &q->q_lock);
 	}
-      /* Should we send the message to this user? */
-      for (i = 0; i < f->f_un.f_user.f_nusers; i++)
-	if (!strncmp (f->f_un.f_user.f_unames[i], UT_USER (utp),
-		      sizeof (UT_USER (utp))))
-	  {
-	    p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
-	    if (p != NULL)
-	      {
-		errno = 0;	/* Already in message. */
-		logerror (p);
-	      }
-	    break;
-	  }
+
+      buf = q->q_buf;
+      q->q_buf = q->q_wbuf;
+      q->q_wbuf = buf;
+      len = q->q_len;
+      q->q_len = 0;
+      dosync = q->q_sync
+	&& (q->q_stop || time (NULL) >= synctime + SyncInterval);
+      if (dosync)
+	q->q_sync = 0;
+      pthread_mutex_unlock (&q->q_lock);
+
+      while (off < len)
+	{
+	  ssize_t n = write (q->q_fd, buf + off, len - off);
+
+	  if (n < 0 && errno == EINTR)
+	    continue;
+	  if (n < 0)
+	    {
+	      err = errno;
+	      break;
+	    }
+	  off += n;
+	}
+      if (!err && dosync)
+	{
+	  bucket = fsync_timed (q->q_fd);
+	  synctime = time (NULL);
+	}
+
+      pthread_mutex_lock (&q->q_lock);
+      if (bucket >= 0)
+	q->q_synchist[bucket]++;
+      if (err)
+	{
+	  q->q_error = err;
+	  q->q_errors++;
+	  break;
+	}
+      if (q->q_stop && q->q_len == 0 && !q->q_sync)
+	break;
+    }
+  pthread_mutex_unlock (&q->q_lock);
+
+  return NULL;
+}
+
+/* Create a writer thread for the file F.  Return zero on success.  */
+static int
+outq_start (struct filed *f)
+{
+  struct outq *q;
+  sigset_t sigs, osigs;
+  int err;
+
+  q = xcalloc (1, sizeof (*q));
+  q->q_fd = f->f_file;
+  q->q_buf = xmalloc (OutputQueue);
+  q->q_wbuf = xmalloc (OutputQueue);
+  pthread_mutex_init (&q->q_lock, NULL);
+  pthread_cond_init (&q->q_cond, NULL);
+
+  /* Signals must be handled by the main thread.  */
+  sigfillset (&sigs);
+  pthread_sigmask (SIG_BLOCK, &sigs, &osigs);
+  err = pthread_create (&q->q_tid, NULL, writer, q);
+  pthread_sigmask (SIG_SETMASK, &osigs, NULL);
+
+  if (err)
+    {
+      pthread_mutex_destroy (&q->q_lock);
+      pthread_cond_destroy (&q->q_cond);
+      free (q->q_buf);
+      free (q->q_wbuf);
+      free (q);
+      errno = err;
+      logerror ("writer thread");
+      return -1;
+    }
+
+  f->f_outq = q;
+  return 0;
+}
+
+/* Queue the message in IOV for the writer thread of F, asking for
+   a sync if SYNC is set.  Return zero if it was queued, 1 if it was
+   dropped, or -1 if the thread has given up on its file.  */
+static int
+outq_put (struct filed *f, struct iovec *iov, int iovcnt, int sync)
+{
+  struct outq *q = f->f_outq;
+  size_t len = 0;
+  int i, rc = 0;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  pthread_mutex_lock (&q->q_lock);
+  if (q->q_error)
+    {
+      pthread_mutex_unlock (&q->q_lock);
+      return -1;
+    }
+
+  if (q->q_len + len > OutputQueue)
+    {
+      q->q_dropped++;
+      rc = 1;
+    }
+  else
+    {
+      f->f_bytes += len;
+      if (q->q_len == 0)
+	pthread_cond_signal (&q->q_cond);
+      for (i = 0; i < iovcnt; i++)
+	{
+	  memcpy (q->q_buf + q->q_len, iov[i].iov_base, iov[i].iov_len);
+	  q->q_len += iov[i].iov_len;
+	}
+      if (q->q_len > q->q_maxlen)
+	q->q_maxlen = q->q_len;
+      q->q_msgs++;
+      if (sync)
+	q->q_sync = 1;
+    }
+  pthread_mutex_unlock (&q->q_lock);
+
+  return rc;
+}
+
+/* Let the writer thread of F finish its queue, and wait for it.  */
+static void
+outq_stop (struct filed *f)
+{
+  struct outq *q = f->f_outq;
+  int i;
+
+  pthread_mutex_lock (&q->q_lock);
+  q->q_stop = 1;
+  pthread_cond_signal (&q->q_cond);
+  pthread_mutex_unlock (&q->q_lock);
+  pthread_join (q->q_tid, NULL);
+
+  for (i = 0; i < SYNCHIST; i++)
+    f->f_synchist[i] += q->q_synchist[i];
+  f->f_errors += q->q_errors;
+
+  if (q->q_dropped)
+    dbg_printf ("%s: dropped %lu messages on a full queue.\n",
+		f->f_un.f_fname, q->q_dropped);
+
+  pthread_mutex_destroy (&q->q_lock);
+  pthread_cond_destroy (&q->q_cond);
+  free (q->q_buf);
+  free (q->q_wbuf);
+  free (q);
+  f->f_outq = NULL;
+}
+
+/* Report the queues of writer threads.  */
+static void
+outq_stats (void)
+{
+  struct filed *f;
+
+  for (f = Files; f; f = f->f_next)
+    {
+      struct outq *q = f->f_outq;
+
+      /* We run in a signal handler, which may have interrupted
+	 outq_put().  */
+      if (q == NULL || pthread_mutex_trylock (&q->q_lock))
+	continue;
+      dbg_printf ("%s: queued %lu messages, dropped %lu, "
+		  "%zu bytes waiting, at most %zu.\n",
+		  f->f_un.f_fname, q->q_msgs, q->q_dropped,
+		  q->q_len, q->q_maxlen);
+      pthread_mutex_unlock (&q->q_lock);
+    }
+}
+
+/* Add the fsync times and errors of the writer thread of F to HIST
+   and ERRORS, and return its backlog.  */
+static size_t
+outq_counters (struct filed *f, unsigned long *hist, unsigned long *errors)
+{
+  struct outq *q = f->f_outq;
+  size_t len;
+  int i;
+
+  pthread_mutex_lock (&q->q_lock);
+  for (i = 0; i < SYNCHIST; i++)
+    hist[i] += q->q_synchist[i];
+  *errors += q->q_errors;
+  len = q->q_len;
+  pthread_mutex_unlock (&q->q_lock);
+
+  return len;
+}
+#else /* !HAVE_PTHREAD_H */
+static int
+outq_start (struct filed *f MAYBE_UNUSED)
+{
+  return -1;
+}
+
+static int
+outq_put (struct filed *f MAYBE_UNUSED, struct iovec *iov MAYBE_UNUSED,
+	  int iovcnt MAYBE_UNUSED, int sync MAYBE_UNUSED)
+{
+  return -1;
+}
+
+static void
+outq_stop (struct filed *f MAYBE_UNUSED)
+{
+}
+
+static void
+outq_stats (void)
+{
+}
+
+static size_t
+outq_counters (struct filed *f MAYBE_UNUSED,
+	       unsigned long *hist MAYBE_UNUSED,
+	       unsigned long *errors MAYBE_UNUSED)
+{
+  return 0;
+}
+#endif /* !HAVE_PTHREAD_H */
+
+/* Call fsync() on FD, and return the bucket of the time it took:
+   below 100 microseconds, 1, 10 or 100 milliseconds, 1 second,
+   or longer.  */
+static int
+fsync_timed (int fd)
+{
+  struct timeval start, end;
+  long usec;
+  int bucket;
+
+  gettimeofday (&start, NULL);
+  fsync (fd);
+  gettimeofday (&end, NULL);
+
+  usec = (end.tv_sec - start.tv_sec) * 1000000L
+    + (end.tv_usec - start.tv_usec);
+  for (bucket = 0, usec /= 100; usec > 0 && bucket < SYNCHIST - 1;
+       usec /= 10)
+    bucket++;
+  return bucket;
+}
+
+/* Write the counters of inputs and actions to StatsFile.  The file
+   is replaced as a whole, so readers never see a partial one.  */
+static void
+write_stats (void)
+{
+  struct filed *f;
+  char *tmp;
+  FILE *fp;
+  size_t i;
+
+  tmp = xmalloc (strlen (StatsFile) + sizeof (".new"));
+  sprintf (tmp, "%s.new", StatsFile);
+  fp = fopen (tmp, "w");
+  if (fp == NULL)
+    {
+      logerror (tmp);
+      free (tmp);
+      return;
+    }
+
+  now = time (NULL);
+  fprintf (fp, "# syslogd statistics at %.15s\n", bsd_time (now));
+  fprintf (fp, "# fsync: <100us <1ms <10ms <100ms <1s >=1s\n");
+
+  for (i = 0; i < nInputs; i++)
+    fprintf (fp, "input name=%s received=%lu bytes=%lu overflows=%lu\n",
+	     Inputs[i].is_name, Inputs[i].is_msgs, Inputs[i].is_bytes,
+	     Inputs[i].is_overflows);
+  fprintf (fp, "reception wakeups=%lu datagrams=%lu maxbatch=%d\n",
+	   RecvWakeups, RecvDatagrams, RecvMaxBatch);
+  fprintf (fp, "ratelimit dropped=%lu senders=%lu\n",
+	   RateDropped, (unsigned long) ratesrc_count);
+  fprintf (fp, "dnscache entries=%d\n", hostcache_count);
+
+  for (f = Files; f; f = f->f_next)
+    {
+      unsigned long hist[SYNCHIST], errors = f->f_errors;
+      unsigned long dropped = f->f_dropped;
+      const char *target = "-";
+      size_t backlog = 0;
+      int j;
+
+      memcpy (hist, f->f_synchist, sizeof (hist));
+
+      switch (f->f_type)
+	{
+	case F_FILE:
+	case F_TTY:
+	case F_CONSOLE:
+	case F_PIPE:
+	  target = f->f_un.f_fname;
+	  if (f->f_outq)
+	    backlog = outq_counters (f, hist, &errors);
+	  else
+	    backlog = f->f_buflen;
+	  break;
+
+	case F_FORW_TCP:
+	  backlog = f->f_un.f_forw.f_tcp->t_len
+	    + (f->f_un.f_forw.f_tcp->t_spoollen
+	       - f->f_un.f_forw.f_tcp->t_spooloff);
+	  dropped += f->f_un.f_forw.f_tcp->t_dropped;
+	  /* Fall through.  */
+	case F_FORW:
+	case F_FORW_SUSP:
+	case F_FORW_UNKN:
+	  target = f->f_un.f_forw.f_hname;
+	  break;
+	}
+      if (target == NULL)
+	target = "-";
+
+      fprintf (fp, "action index=%d type=%s target=%s messages=%lu "
+	       "bytes=%lu errors=%lu dropped=%lu backlog=%lu fsync=",
+	       f->f_index, TypeNames[f->f_type], target, f->f_msgs,
+	       f->f_bytes, errors, dropped, (unsigned long) backlog);
+      for (j = 0; j < SYNCHIST; j++)
+	fprintf (fp, "%lu%c", hist[j], j < SYNCHIST - 1 ? ',' : '\n');
+    }
+
+  if (fclose (fp) != 0 || rename (tmp, StatsFile) != 0)
+    logerror (StatsFile);
+  free (tmp);
+}
+
+/* Look up the addresses of HOST and PORT for T, keeping the former
+   ones if that fails.  */
+static void
+tcpforw_resolve (struct tcpforw *t, const char *host, const char *port)
+{
+  struct addrinfo hints, *rp;
+  int err;
+
+  t->t_resolved = time (NULL);
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = usefamily;
+  hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_ADDRCONFIG
+  if (usefamily == AF_UNSPEC)
+    hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+
+  err = getaddrinfo (host, port, &hints, &rp);
+  if (err)
+    {
+      dbg_printf ("Cannot resolve %s: %s\n", host, gai_strerror (err));
+      return;
+    }
+
+  if (t->t_ai)
+    freeaddrinfo (t->t_ai);
+  t->t_ai = rp;
+}
+
+/* Create the queue of a TCP forwarding action towards HOST and PORT,
+   and look up their addresses.  Any spool file left from an earlier
+   run is picked up.  */
+static struct tcpforw *
+tcpforw_new (const char *host, const char *port)
+{
+  struct tcpforw *t;
+
+  t = xcalloc (1, sizeof (*t));
+  t->t_port = xstrdup (port);
+  t->t_fd = -1;
+  t->t_spoolfd = -1;
+  t->t_size = TcpQueueSize;
+  t->t_buf = xmalloc (t->t_size);
+  tcpforw_resolve (t, host, port);
+
+  if (SpoolDir)
+    {
+      struct stat st;
+      char *p;
+
+      if (asprintf (&t->t_spool, "%s/%s_%s.spool", SpoolDir, host, port) < 0)
+	{
+	  t->t_spool = NULL;
+	  return t;
+	}
+
+      /* Keep the spool file inside SpoolDir.  */
+      for (p = t->t_spool + strlen (SpoolDir) + 1; *p; p++)
+	if (*p == '/')
+	  *p = '_';
+
+      t->t_spoolfd = open (t->t_spool, O_RDWR | O_CREAT | O_APPEND, 0600);
+      if (t->t_spoolfd < 0 || fstat (t->t_spoolfd, &st) < 0)
+	{
+	  logerror (t->t_spool);
+	  if (t->t_spoolfd >= 0)
+	    close (t->t_spoolfd);
+	  t->t_spoolfd = -1;
+	  free (t->t_spool);
+	  t->t_spool = NULL;
+	}
+      else
+	t->t_spoollen = st.st_size;
+    }
+
+  return t;
+}
+
+/* Copy LEN bytes from DATA to the end of the ring buffer of T.  */
+static void
+tcpq_put (struct tcpforw *t, const char *data, size_t len)
+{
+  size_t tail = (t->t_head + t->t_len) % t->t_size;
+  size_t n = MIN (len, t->t_size - tail);
+
+  memcpy (t->t_buf + tail, data, n);
+  memcpy (t->t_buf, data + n, len - n);
+  t->t_len += len;
+}
+
+/* Return the length of the oldest frame of T, including the octet
+   count, or zero if the count is incomplete.  */
+static size_t
+tcpq_framelen (struct tcpforw *t)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < t->t_len; i++)
+    {
+      char c = t->t_buf[(t->t_head + i) % t->t_size];
+
+      if (c == ' ')
+	return n + i + 1;
+      n = 10 * n + (c - '0');
+    }
+
+  return 0;
+}
+
+/* Move spooled frames of T into its ring buffer, as far as they fit.
+   An exhausted spool file is truncated.  */
+static void
+tcpq_refill (struct tcpforw *t)
+{
+  if (t->t_spoolfd < 0)
+    return;
+
+  while (t->t_spooloff < t->t_spoollen && t->t_len < t->t_size)
+    {
+      size_t tail = (t->t_head + t->t_len) % t->t_size;
+      size_t room = MIN (t->t_size - t->t_len, t->t_size - tail);
+      ssize_t n;
+
+      if ((off_t) room > t->t_spoollen - t->t_spooloff)
+	room = t->t_spoollen - t->t_spooloff;
+
+      n = pread (t->t_spoolfd, t->t_buf + tail, room, t->t_spooloff);
+      if (n <= 0)
+	{
+	  if (n < 0)
+	    logerror (t->t_spool);
+	  t->t_spooloff = t->t_spoollen;	/* Give up the rest.  */
+	  break;
+	}
+      t->t_len += n;
+      t->t_spooloff += n;
+    }
+
+  if (t->t_spooloff > 0 && t->t_spooloff >= t->t_spoollen)
+    {
+      if (ftruncate (t->t_spoolfd, 0) < 0)
+	logerror (t->t_spool);
+      t->t_spooloff = t->t_spoollen = 0;
+    }
+}
+
+/* Close the connection of T, and schedule a new attempt.
+   Frames partially sent will be sent again in full.  */
+static void
+tcpforw_disconnect (struct tcpforw *t)
+{
+  if (t->t_fd >= 0)
+    close (t->t_fd);
+  t->t_fd = -1;
+  t->t_connected = 0;
+  t->t_sent = 0;
+  t->t_retry = now + TCPFORWRETRY;
+}
+
+/* Start a non-blocking connection attempt for F, unless one is in
+   progress, or the last one was too recent.  The addresses of the
+   collector are looked up again at most every INET_SUSPEND_TIME
+   seconds, since the lookup blocks.  */
+static void
+tcpforw_connect (struct filed *f)
+{
+  struct tcpforw *t = f->f_un.f_forw.f_tcp;
+  struct addrinfo *ai;
+
+  if (t->t_fd >= 0 || now < t->t_retry)
+    return;
+  t->t_retry = now + TCPFORWRETRY;
+
+  if (now >= t->t_resolved + INET_SUSPEND_TIME)
+    tcpforw_resolve (t, f->f_un.f_forw.f_hname, t->t_port);
+  if (t->t_ai == NULL)
+    return;
+
+  for (ai = t->t_ai; ai; ai = ai->ai_next)
+    {
+      t->t_fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (t->t_fd < 0)
+	continue;
+
+      fcntl (t->t_fd, F_SETFL, fcntl (t->t_fd, F_GETFL) | O_NONBLOCK);
+
+      if (connect (t->t_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	{
+	  t->t_connected = 1;
+	  break;
+	}
+      else if (errno == EINPROGRESS)
+	break;
+
+      close (t->t_fd);
+      t->t_fd = -1;
+    }
+
+  t->t_sent = 0;
+  dbg_printf ("%s to %s.\n", t->t_connected ? "Connected"
+	      : (t->t_fd >= 0) ? "Connecting" : "Failed to connect",
+	      f->f_un.f_forw.f_hname);
+}
+
+/* Write as many queued frames of T as the connection accepts.  */
+static void
+tcpforw_send (struct tcpforw *t)
+{
+  while (t->t_fd >= 0 && t->t_connected)
+    {
+      struct iovec iov[2];
+      struct msghdr mh;
+      size_t start, n, fl;
+      ssize_t rc;
+
+      if (t->t_sent >= t->t_len)
+	{
+	  tcpq_refill (t);
+	  if (t->t_sent >= t->t_len)
+	    break;
+	}
+
+      start = (t->t_head + t->t_sent) % t->t_size;
+      n = t->t_len - t->t_sent;
+      iov[0].iov_base = t->t_buf + start;
+      iov[0].iov_len = MIN (n, t->t_size - start);
+      iov[1].iov_base = t->t_buf;
+      iov[1].iov_len = n - iov[0].iov_len;
+
+      memset (&mh, 0, sizeof (mh));
+      mh.msg_iov = iov;
+      mh.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+      rc = sendmsg (t->t_fd, &mh, 0);
+      if (rc < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    {
+	      dbg_printf ("TCP forwarding failed: %s\n", strerror (errno));
+	      tcpforw_disconnect (t);
+	    }
+	  break;
+	}
+      t->t_sent += rc;
+
+      /* Release the frames that are sent completely.  */
+      while ((fl = tcpq_framelen (t)) > 0 && fl <= t->t_sent)
+	{
+	  t->t_head = (t->t_head + fl) % t->t_size;
+	  t->t_len -= fl;
+	  t->t_sent -= fl;
+	}
+      tcpq_refill (t);
+    }
+}
+
+/* Queue the message MSG of length LEN for the TCP forwarding action F,
+   and send what is possible.  Messages are spooled, or else dropped,
+   when the ring buffer is full.  Return zero if the message was queued,
+   and -1 if it was dropped.  */
+static int
+tcpforw_queue (struct filed *f, const char *msg, size_t len)
+{
+  struct tcpforw *t = f->f_un.f_forw.f_tcp;
+  char frame[MAXLINE + 16];
+  ssize_t rc;
+  size_t n;
+  int queued = 0;
+
+  n = snprintf (frame, sizeof (frame), "%lu %.*s",
+		(unsigned long) len, (int) len, msg);
+
+  /* Spooled frames must go first.  */
+  if (t->t_spooloff >= t->t_spoollen && t->t_len + n <= t->t_size)
+    {
+      tcpq_put (t, frame, n);
+      queued = 1;
+    }
+  else if (t->t_spoolfd >= 0 && t->t_spoollen + (off_t) n <= SpoolMax)
+    {
+      rc = write (t->t_spoolfd, frame, n);
+      if (rc == (ssize_t) n)
+	{
+	  t->t_spoollen += n;
+	  queued = 1;
+	}
+      /* A partial frame would break the octet counting.  */
+      else if (rc > 0 && ftruncate (t->t_spoolfd, t->t_spoollen) < 0)
+	logerror (t->t_spool);
+    }
+
+  if (!queued)
+    {
+      t->t_dropped++;
+      dbg_printf ("Queue for %s is full, %lu messages dropped.\n",
+		  f->f_un.f_forw.f_hname, t->t_dropped);
+    }
+
+  if (t->t_fd < 0)
+    tcpforw_connect (f);
+  tcpforw_send (t);
+
+  return queued ? 0 : -1;
+}
+
+/* Fill in PFD for the connections of TCP forwarding actions, in the
+   order of TcpForw, and return their number.  Connections are
+   attempted when due, otherwise *DUE is lowered to the time of the
+   next attempt.  */
+static size_t
+tcpforw_pollfds (struct pollfd *pfd, time_t *due)
+{
+  size_t i;
+
+  now = time (NULL);
+
+  for (i = 0; i < nTcpForw; i++)
+    {
+      struct tcpforw *t = TcpForw[i]->f_un.f_forw.f_tcp;
+
+      if (t->t_fd < 0 && (t->t_len || t->t_spooloff < t->t_spoollen))
+	{
+	  tcpforw_connect (TcpForw[i]);
+	  if (t->t_fd < 0 && (*due == 0 || t->t_retry < *due))
+	    *due = t->t_retry;
+	}
+
+      /* An unused slot is ignored by poll().  */
+      pfd[i].fd = t->t_fd;
+      pfd[i].revents = 0;
+      if (!t->t_connected)
+	pfd[i].events = POLLOUT;
+      else if (t->t_sent < t->t_len || t->t_spooloff < t->t_spoollen)
+	pfd[i].events = POLLIN | POLLOUT;
+      else
+	pfd[i].events = POLLIN;
+    }
+
+  return nTcpForw;
+}
+
+/* Handle the events REVENTS for the connection of F.  */
+static void
+tcpforw_event (struct filed *f, int revents)
+{
+  struct tcpforw *t = f->f_un.f_forw.f_tcp;
+
+  now = time (NULL);
+
+  if (t->t_fd < 0)
+    return;
+
+  if (!t->t_connected)
+    {
+      int err = 0;
+      socklen_t len = sizeof (err);
+
+      if (getsockopt (t->t_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+	err = errno;
+      if (err)
+	{
+	  dbg_printf ("Cannot connect to %s: %s\n",
+		      f->f_un.f_forw.f_hname, strerror (err));
+	  tcpforw_disconnect (t);
+	  return;
+	}
+      t->t_connected = 1;
+      dbg_printf ("Connected to %s.\n", f->f_un.f_forw.f_hname);
+    }
+
+  /* The collector never speaks, so input signals a closed connection.  */
+  if (revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      char buf[128];
+      ssize_t n = recv (t->t_fd, buf, sizeof (buf), MSG_DONTWAIT);
+
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+		     && errno != EINTR))
+	{
+	  dbg_printf ("Connection to %s closed.\n", f->f_un.f_forw.f_hname);
+	  tcpforw_disconnect (t);
+	  return;
+	}
+    }
+
+  if (revents & POLLOUT)
+    tcpforw_send (t);
+}
+
+/* Release the TCP forwarding state of F.  Unsent frames are saved
+   in front of the spool file, if there is one, so that they are
+   sent after a restart.  */
+static void
+tcpforw_free (struct filed *f)
+{
+  struct tcpforw *t = f->f_un.f_forw.f_tcp;
+
+  if (t == NULL)
+    return;
+
+  if (t->t_fd >= 0)
+    close (t->t_fd);
+
+  if (t->t_spoolfd >= 0 && t->t_len > 0)
+    {
+      char *tmp;
+      int fd = -1;
+
+      if (asprintf (&tmp, "%s.new", t->t_spool) >= 0)
+	{
+	  fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	  if (fd >= 0)
+	    {
+	      size_t n = MIN (t->t_len, t->t_size - t->t_head);
+	      char buf[4096];
+	      ssize_t rc = 0;
+	      int ok;
+
+	      ok = write (fd, t->t_buf + t->t_head, n) == (ssize_t) n
+		&& write (fd, t->t_buf, t->t_len - n)
+		   == (ssize_t) (t->t_len - n);
+
+	      while (ok && t->t_spooloff < t->t_spoollen
+		     && (rc = pread (t->t_spoolfd, buf, sizeof (buf),
+				     t->t_spooloff)) > 0)
+		{
+		  ok = write (fd, buf, rc) == rc;
+		  t->t_spooloff += rc;
+		}
+
+	      if (close (fd) < 0 || !ok || rc < 0
+		  || rename (tmp, t->t_spool) < 0)
+		{
+		  logerror (t->t_spool);
+		  unlink (tmp);
+		}
+	    }
+	  else
+	    logerror (tmp);
+	  free (tmp);
+	}
+    }
+  else if (t->t_len > 0)
+    dbg_printf ("Discarding %lu queued bytes for %s.\n",
+		(unsigned long) t->t_len, f->f_un.f_forw.f_hname);
+
+  if (t->t_spoolfd >= 0)
+    close (t->t_spoolfd);
+  free (t->t_spool);
+  free (t->t_port);
+  if (t->t_ai)
+    freeaddrinfo (t->t_ai);
+  free (t->t_buf);
+  free (t);
+  f->f_un.f_forw.f_tcp = NULL;
+}
+
+/* Write the specified message to either the entire world,
+ * or to a list of approved users.  */
+void
+wallmsg (struct filed *f, struct iovec *iov)
+{
+  static int reenter;		/* Avoid calling ourselves.  */
+  STRUCT_UTMP *utp;
+#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
+  STRUCT_UTMP *utmpbuf;
+  size_t utmp_count;
+#endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
+  int i;
+  char *p;
+  char line[sizeof (utp->ut_line) + 1];
+
+  if (reenter++)
+    return;
+
+#if !defined UTMP_NAME_FUNCTION && defined HAVE_GETUTXENT
+  setutxent ();
+
+  while ((utp = getutxent ()))
+#else /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
+  if (read_utmp (UTMP_FILE, &utmp_count, &utmpbuf,
+		 READ_UTMP_USER_PROCESS | READ_UTMP_CHECK_PIDS) < 0)
+    {
+      logerror ("opening utmp file");
+      return;
+    }
+
+  for (utp = utmpbuf; utp < utmpbuf + utmp_count; utp++)
+#endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
+    {
+      strncpy (line, utp->ut_line, sizeof (utp->ut_line));
+      line[sizeof (utp->ut_line)] = '\0';
+      if (f->f_type == F_WALL)
+	{
+	  /* Note we're using our own version of ttymsg
+	     which does a double fork () to not have
+	     zombies.  No need to waitpid().  */
+	  p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
+	  if (p != NULL)
+	    {
+	      errno = 0;	/* Already in message. */
+	      logerror (p);
+	    }
+	  continue;
+	}
+      /* Should we send the message to this user? */
+      for (i = 0; i < f->f_un.f_user.f_nusers; i++)
+	if (!strncmp (f->f_un.f_user.f_unames[i], UT_USER (utp),
+		      sizeof (UT_USER (utp))))
+	  {
+	    p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
+	    if (p != NULL)
+	      {
+		errno = 0;	/* Already in message. */
+		logerror (p);
+	      }
+	    break;
+	  }
+    }
+#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
+  free (utmpbuf);
+#else /* !UTMP_NAME_FUNCTION && HAVE_GETUTXENT */
+  endutxent ();
+#endif
+  reenter = 0;
+}
+
+/* FNV-1a hash of LEN bytes at KEY.  */
+static unsigned
+hash_bytes (const void *key, size_t len)
+{
+  const unsigned char *p = key;
+  unsigned h = 2166136261U;
+
+  while (len--)
+    h = (h ^ *p++) * 16777619U;
+  return h;
+}
+
+/* Locate the address part of F, which is the key of the host cache.
+   Return its length, or zero for unsupported families.  */
+static size_t
+hostcache_key (const struct sockaddr *f, const unsigned char **key)
+{
+  switch (f->sa_family)
+    {
+    case AF_INET:
+      *key = (const unsigned char *) &((const struct sockaddr_in *) f)->sin_addr;
+      return sizeof (struct in_addr);
+
+    case AF_INET6:
+      *key = (const unsigned char *) &((const struct sockaddr_in6 *) f)->sin6_addr;
+      return sizeof (struct in6_addr);
+
+    default:
+      return 0;
+    }
+}
+
+static unsigned
+hostcache_hash (const unsigned char *key, size_t len)
+{
+  return hash_bytes (key, len) % DNSCACHE_HASH;
+}
+
+/* Remove HC from the LRU list.  */
+static void
+hostcache_unlink (struct hostcache *hc)
+{
+  if (hc->hc_newer)
+    hc->hc_newer->hc_older = hc->hc_older;
+  else
+    hostcache_newest = hc->hc_older;
+  if (hc->hc_older)
+    hc->hc_older->hc_newer = hc->hc_newer;
+  else
+    hostcache_oldest = hc->hc_newer;
+  hc->hc_newer = hc->hc_older = NULL;
+}
+
+/* Make HC the most recently used entry.  */
+static void
+hostcache_touch (struct hostcache *hc)
+{
+  if (hostcache_newest == hc)
+    return;
+  if (hc->hc_newer || hc->hc_older)
+    hostcache_unlink (hc);
+  hc->hc_older = hostcache_newest;
+  if (hostcache_newest)
+    hostcache_newest->hc_newer = hc;
+  hostcache_newest = hc;
+  if (!hostcache_oldest)
+    hostcache_oldest = hc;
+}
+
+/* Remove HC from the cache and release it.  */
+static void
+hostcache_drop (struct hostcache *hc)
+{
+  const unsigned char *key;
+  struct hostcache **hp;
+  size_t len;
+
+  len = hostcache_key ((struct sockaddr *) &hc->hc_addr, &key);
+  for (hp = &hostcache_tab[hostcache_hash (key, len)]; *hp;
+       hp = &(*hp)->hc_next)
+    if (*hp == hc)
+      {
+	*hp = hc->hc_next;
+	break;
+      }
+  hostcache_unlink (hc);
+  hostcache_count--;
+  free (hc->hc_name);
+  free (hc);
+}
+
+/* Return the entry for the address of F, or NULL.  */
+static struct hostcache *
+hostcache_find (const struct sockaddr *f)
+{
+  const unsigned char *key, *hkey;
+  struct hostcache *hc;
+  size_t len;
+
+  len = hostcache_key (f, &key);
+  if (len == 0)
+    return NULL;
+
+  for (hc = hostcache_tab[hostcache_hash (key, len)]; hc; hc = hc->hc_next)
+    if (hc->hc_addr.ss_family == f->sa_family
+	&& hostcache_key ((struct sockaddr *) &hc->hc_addr, &hkey) == len
+	&& memcmp (hkey, key, len) == 0)
+      return hc;
+
+  return NULL;
+}
+
+/* Record NAME for the address of F, valid for TTL seconds.
+   The least recently used entry is evicted if the cache is full.  */
+static struct hostcache *
+hostcache_enter (const struct sockaddr *f, socklen_t len, const char *name,
+		 int ttl)
+{
+  const unsigned char *key;
+  struct hostcache *hc;
+  size_t keylen;
+
+  keylen = hostcache_key (f, &key);
+  if (DnsCacheSize <= 0 || keylen == 0 || len > sizeof (hc->hc_addr))
+    return NULL;
+
+  hc = hostcache_find (f);
+  if (hc)
+    free (hc->hc_name);
+  else
+    {
+      unsigned h;
+
+      while (hostcache_count >= DnsCacheSize && hostcache_oldest)
+	hostcache_drop (hostcache_oldest);
+
+      hc = xcalloc (1, sizeof (*hc));
+      memcpy (&hc->hc_addr, f, len);
+      h = hostcache_hash (key, keylen);
+      hc->hc_next = hostcache_tab[h];
+      hostcache_tab[h] = hc;
+      hostcache_count++;
+    }
+
+  hc->hc_name = xstrdup (name);
+  hc->hc_expire = time (NULL) + ttl;
+  hc->hc_pending = 0;
+  hostcache_touch (hc);
+
+  return hc;
+}
+
+/* Forget every cached name.  Results of background lookups
+   requested before this call will be discarded.  */
+static void
+hostcache_flush (void)
+{
+  while (hostcache_oldest)
+    hostcache_drop (hostcache_oldest);
+  hostcache_gen++;
+}
+
+/* Shorten the resolved name NAME according to LocalDomain,
+   StripDomains, and LocalHosts.  */
+static void
+strip_hostname (char *name)
+{
+  char *p;
+  int count;
+
+  p = strchr (name, '.');
+  if (p == NULL)
+    return;
+
+  if (strcasecmp (p + 1, LocalDomain) == 0)
+    {
+      *p = '\0';
+      return;
+    }
+
+  if (StripDomains)
+    for (count = 0; StripDomains[count]; count++)
+      if (strcasecmp (p + 1, StripDomains[count]) == 0)
+	{
+	  *p = '\0';
+	  return;
+	}
+
+  if (LocalHosts)
+    for (count = 0; LocalHosts[count]; count++)
+      if (strcasecmp (name, LocalHosts[count]) == 0)
+	{
+	  *p = '\0';
+	  return;
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Body of the resolver thread.  It serves queued requests in
+   DNSREQ, and writes a byte to DNS_PIPE whenever one is done.  */
+static void *
+resolver (void *arg MAYBE_UNUSED)
+{
+  pthread_mutex_lock (&dnsreq_lock);
+  for (;;)
+    {
+      struct dnsreq *rq = NULL;
+      int i;
+
+      for (i = 0; i < DNSREQ_MAX; i++)
+	if (dnsreq[i].r_state == DNSREQ_QUEUED)
+	  {
+	    rq = &dnsreq[i];
+	    break;
+	  }
+
+      if (rq == NULL)
+	{
+	  pthread_cond_wait (&dnsreq_cond, &dnsreq_lock);
+	  continue;
+	}
+
+      rq->r_state = DNSREQ_BUSY;
+      pthread_mutex_unlock (&dnsreq_lock);
+
+      rq->r_err = getnameinfo ((struct sockaddr *) &rq->r_addr, rq->r_addrlen,
+			       rq->r_name, sizeof (rq->r_name),
+			       NULL, 0, NI_NAMEREQD);
+
+      pthread_mutex_lock (&dnsreq_lock);
+      rq->r_state = DNSREQ_DONE;
+      (void) write (dns_pipe[1], "", 1);
+    }
+
+  return NULL;
+}
+
+/* Create the resolver thread.  Return zero on success.  */
+static int
+start_resolver (void)
+{
+  pthread_t tid;
+  sigset_t sigs, osigs;
+  int err;
+
+  if (pipe (dns_pipe) < 0)
+    {
+      logerror ("resolver pipe");
+      return -1;
+    }
+  fcntl (dns_pipe[0], F_SETFL, fcntl (dns_pipe[0], F_GETFL) | O_NONBLOCK);
+
+  /* Signals must be handled by the main thread.  */
+  sigfillset (&sigs);
+  pthread_sigmask (SIG_BLOCK, &sigs, &osigs);
+  err = pthread_create (&tid, NULL, resolver, NULL);
+  pthread_sigmask (SIG_SETMASK, &osigs, NULL);
+
+  if (err)
+    {
+      errno = err;
+      logerror ("resolver thread");
+      close (dns_pipe[0]);
+      close (dns_pipe[1]);
+      dns_pipe[0] = dns_pipe[1] = -1;
+      return -1;
+    }
+
+  pthread_detach (tid);
+  return 0;
+}
+
+/* Hand the address F over to the resolver thread.
+   Return zero on success, or -1 if all slots are taken.  */
+static int
+queue_resolver (const struct sockaddr *f, socklen_t len)
+{
+  int i, rc = -1;
+
+  pthread_mutex_lock (&dnsreq_lock);
+  for (i = 0; i < DNSREQ_MAX; i++)
+    if (dnsreq[i].r_state == DNSREQ_FREE)
+      {
+	memcpy (&dnsreq[i].r_addr, f, len);
+	dnsreq[i].r_addrlen = len;
+	dnsreq[i].r_gen = hostcache_gen;
+	dnsreq[i].r_state = DNSREQ_QUEUED;
+	pthread_cond_signal (&dnsreq_cond);
+	rc = 0;
+	break;
+      }
+  pthread_mutex_unlock (&dnsreq_lock);
+
+  return rc;
+}
+
+/* Move finished lookups into the host cache.  */
+static void
+collect_resolver (void)
+{
+  char buf[DNSREQ_MAX];
+  int i;
+
+  while (read (dns_pipe[0], buf, sizeof (buf)) > 0)
+    ;
+
+  pthread_mutex_lock (&dnsreq_lock);
+  for (i = 0; i < DNSREQ_MAX; i++)
+    {
+      struct dnsreq *rq = &dnsreq[i];
+
+      if (rq->r_state != DNSREQ_DONE)
+	continue;
+
+      if (rq->r_gen == hostcache_gen)
+	{
+	  if (rq->r_err == 0)
+	    {
+	      strip_hostname (rq->r_name);
+	      dbg_printf ("Resolved in background: %s.\n", rq->r_name);
+	      hostcache_enter ((struct sockaddr *) &rq->r_addr, rq->r_addrlen,
+			       rq->r_name, DnsCacheTtl);
+	    }
+	  else
+	    {
+	      struct hostcache *hc;
+
+	      /* Keep the numerical name, but stop waiting.  */
+	      hc = hostcache_find ((struct sockaddr *) &rq->r_addr);
+	      if (hc)
+		{
+		  hc->hc_pending = 0;
+		  hc->hc_expire = time (NULL) + DNSCACHE_NEGTTL;
+		}
+	    }
+	}
+      rq->r_state = DNSREQ_FREE;
     }
-#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
-  free (utmpbuf);
-#else /* !UTMP_NAME_FUNCTION && HAVE_GETUTXENT */
-  endutxent ();
-#endif
-  reenter = 0;
+  pthread_mutex_unlock (&dnsreq_lock);
+}
+#else /* !HAVE_PTHREAD_H */
+static int
+start_resolver (void)
+{
+  return -1;
+}
+
+static int
+queue_resolver (const struct sockaddr *f MAYBE_UNUSED,
+		socklen_t len MAYBE_UNUSED)
+{
+  return -1;
+}
+
+static void
+collect_resolver (void)
+{
 }
+#endif /* !HAVE_PTHREAD_H */
 
-/* Return a printable representation of a host address.  */
+/* Return a printable representation of a host address.
+   Names are cached, failed lookups included.  With DnsAsync
+   an unknown address is logged numerically, while its name
+   is looked up in the background.  */
 const char *
 cvthname (struct sockaddr *f, socklen_t len)
 {
+  struct hostcache *hc;
   int err;
-  char *p;
 
   err = getnameinfo (f, len, addrstr, sizeof (addrstr),
 		     NULL, 0, NI_NUMERICHOST);
@@ -1693,51 +4635,33 @@ cvthname (struct sockaddr *f, socklen_t len)
 
   dbg_printf ("cvthname(%s)\n", addrstr);
 
+  hc = hostcache_find (f);
+  if (hc && (hc->hc_pending || time (NULL) < hc->hc_expire))
+    {
+      hostcache_touch (hc);
+      return hc->hc_name;
+    }
+
+  if (DnsAsync)
+    {
+      /* Log the numerical address until the name is known.  */
+      hc = hostcache_enter (f, len, addrstr, DNSCACHE_NEGTTL);
+      if (hc && queue_resolver (f, len) == 0)
+	hc->hc_pending = 1;
+      return addrstr;
+    }
+
   err = getnameinfo (f, len, addrname, sizeof (addrname),
 		     NULL, 0, NI_NAMEREQD);
   if (err)
     {
       dbg_printf ("Host name for your address (%s) unknown.\n", addrstr);
+      hostcache_enter (f, len, addrstr, DNSCACHE_NEGTTL);
       return addrstr;
     }
 
-  p = strchr (addrname, '.');
-  if (p != NULL)
-    {
-      if (strcasecmp (p + 1, LocalDomain) == 0)
-	*p = '\0';
-      else
-	{
-	  int count;
-
-	  if (StripDomains)
-	    {
-	      count = 0;
-	      while (StripDomains[count])
-		{
-		  if (strcasecmp (p + 1, StripDomains[count]) == 0)
-		    {
-		      *p = '\0';
-		      return addrname;
-		    }
-		  count++;
-		}
-	    }
-	  if (LocalHosts)
-	    {
-	      count = 0;
-	      while (LocalHosts[count])
-		{
-		  if (strcasecmp (addrname, LocalHosts[count]) == 0)
-		    {
-		      *p = '\0';
-		      return addrname;
-		    }
-		  count++;
-		}
-	    }
-	}
-    }
+  strip_hostname (addrname);
+  hostcache_enter (f, len, addrname, DnsCacheTtl);
   return addrname;
 }
 
@@ -1769,9 +4693,12 @@ domark (int signo MAYBE_UNUSED)
 	}
     }
 
-#ifndef HAVE_SIGACTION
-  signal (SIGALRM, domark);
-#endif
+  if (FlushDue)
+    flush_files (FLUSH_ALL);
+
+  if (RateBurst)
+    ratelimit_sweep (0);
+
   alarm (TIMERINTVL);
 }
 
@@ -1812,6 +4739,8 @@ die (int signo)
 	fprintlog (f, LocalHostName, 0, (char *) NULL);
     }
   Initialized = was_initialized;
+  if (RateBurst)
+    ratelimit_sweep (1);
   if (signo)
     {
       dbg_printf ("%s: exiting on signal %d\n",
@@ -1821,8 +4750,20 @@ die (int signo)
       logerror (buf);
     }
 
+  flush_files (FLUSH_ALL | FLUSH_SYNC);
+
+  for (f = Files; f != NULL; f = f->f_next)
+    if (f->f_outq)
+      outq_stop (f);
+    else if (f->f_type == F_FORW_TCP)
+      tcpforw_free (f);
+
   if (fklog >= 0)
     close (fklog);
+#ifdef PATH_KMSG
+  if (kmsg_statefd >= 0)
+    close (kmsg_statefd);
+#endif
 
   for (i = 0; i < nfunix; i++)
     if (funix[i].fd >= 0)
@@ -1837,6 +4778,14 @@ die (int signo)
   if (finet[IU_FD_IP6] >= 0)
     close (finet[IU_FD_IP6]);
 
+  if (ftcp[IU_FD_IP4] >= 0)
+    close (ftcp[IU_FD_IP4]);
+  if (ftcp[IU_FD_IP6] >= 0)
+    close (ftcp[IU_FD_IP6]);
+  for (i = 0; i < nTcpConn; i++)
+    if (TcpConn[i].c_fd >= 0)
+      close (TcpConn[i].c_fd);
+
   exit (EXIT_SUCCESS);
 }
 
@@ -2017,6 +4966,23 @@ load_conffile (const char *filename, struct filed **nextp)
 
       *++p = '\0';
 
+      /* Rate limit of senders: "ratelimit INTERVAL BURST".  */
+      if (strncmp (cbuf, "ratelimit", 9) == 0 && isspace (cbuf[9]))
+	{
+	  long interval, burst;
+
+	  interval = strtol (cbuf + 9, &p, 10);
+	  burst = strtol (p, &p, 10);
+	  if (*p || interval < 0 || burst < 0 || (interval == 0) != (burst == 0))
+	    logerror ("invalid ratelimit line");
+	  else
+	    {
+	      RateInterval = interval;
+	      RateBurst = burst;
+	    }
+	  continue;
+	}
+
       /* Send the line for more parsing.
        * Then generate the new entry,
        * inserting it at the head of
@@ -2086,7 +5052,166 @@ load_confdir (const char *dirname, struct filed **nextp)
   return (found ? rc : 1);
 }
 
-/* INIT -- Initialize syslogd from configuration table.  */
+/* Release the action F, with whatever output it still holds.  */
+static void
+free_filed (struct filed *f)
+{
+  int j;
+
+  if (f->f_outq)
+    outq_stop (f);
+  if (f->f_type == F_FILE)
+    filebuf_flush (f, 1);
+
+  switch (f->f_type)
+    {
+    case F_FILE:
+    case F_TTY:
+    case F_CONSOLE:
+    case F_PIPE:
+      free (f->f_un.f_fname);
+      close (f->f_file);
+      break;
+    case F_FORW_TCP:
+      tcpforw_free (f);
+      free (f->f_un.f_forw.f_hname);
+      break;
+    case F_FORW:
+    case F_FORW_SUSP:
+    case F_FORW_UNKN:
+      free (f->f_un.f_forw.f_hname);
+      break;
+    case F_USERS:
+      for (j = 0; j < f->f_un.f_user.f_nusers; ++j)
+	free (f->f_un.f_user.f_unames[j]);
+      free (f->f_un.f_user.f_unames);
+      break;
+    }
+  free (f->f_progname);
+  free (f->f_prevhost);
+  release_savedline (f->f_prevline);
+  free (f->f_buf);
+  free (f);
+}
+
+/* Return the output format named by a `;FORMAT' suffix of the action
+   P, and set *LEN to the length of the action without it.  Text after
+   the last semicolon counts only if it is a known format name, since
+   file names and commands may contain semicolons.  */
+static int
+action_format (const char *p, size_t *len)
+{
+  const char *q = strrchr (p, ';');
+  int i;
+
+  *len = strlen (p);
+  if (q)
+    for (i = 0; FormatNames[i]; i++)
+      if (strcasecmp (q + 1, FormatNames[i]) == 0)
+	{
+	  *len = q - p;
+	  return i;
+	}
+
+  return OutputFormat;
+}
+
+/* Find an action of the previous configuration, which has not been
+   taken over, with the same target as a new action of type TYPE.
+   NAME is the file name, including the leading `|' of a pipe, or
+   the name of the remote host.  PORT is the port of TCP forwarding.
+   A file is only kept while NAME still refers to it, so that rotated
+   files are opened anew.  */
+static struct filed *
+find_old_action (int type, const char *name, const char *port)
+{
+  struct filed *o;
+  struct stat st, ost;
+
+  if (name == NULL)
+    return NULL;
+
+  for (o = OldFiles; o; o = o->f_next)
+    switch (o->f_type)
+      {
+      case F_FILE:
+      case F_TTY:
+      case F_CONSOLE:
+      case F_PIPE:
+	if (type == F_FILE && strcmp (o->f_un.f_fname, name) == 0
+	    && stat (name + (*name == '|'), &st) == 0
+	    && fstat (o->f_file, &ost) == 0
+	    && st.st_dev == ost.st_dev && st.st_ino == ost.st_ino)
+	  return o;
+	break;
+
+      case F_FORW:
+	if (type == F_FORW && strcmp (o->f_un.f_forw.f_hname, name) == 0)
+	  return o;
+	break;
+
+      case F_FORW_TCP:
+	if (type == F_FORW_TCP && o->f_un.f_forw.f_tcp
+	    && strcmp (o->f_un.f_forw.f_hname, name) == 0
+	    && strcmp (o->f_un.f_forw.f_tcp->t_port, port) == 0)
+	  return o;
+	break;
+      }
+
+  return NULL;
+}
+
+/* Let the new action F take over the open file, resolved address,
+   or connection of the old action O, along with its buffered output
+   and counters.  O is left unused.  */
+static void
+take_over_action (struct filed *f, struct filed *o)
+{
+  switch (o->f_type)
+    {
+    case F_FILE:
+    case F_TTY:
+    case F_CONSOLE:
+    case F_PIPE:
+      f->f_file = o->f_file;
+      f->f_un.f_fname = o->f_un.f_fname;
+      break;
+
+    case F_FORW:
+      f->f_un.f_forw.f_addr = o->f_un.f_forw.f_addr;
+      f->f_un.f_forw.f_addrlen = o->f_un.f_forw.f_addrlen;
+      free (o->f_un.f_forw.f_hname);
+      break;
+
+    case F_FORW_TCP:
+      f->f_un.f_forw.f_tcp = o->f_un.f_forw.f_tcp;
+      free (o->f_un.f_forw.f_hname);
+      break;
+    }
+  f->f_type = o->f_type;
+
+  f->f_buf = o->f_buf;
+  f->f_buflen = o->f_buflen;
+  f->f_buftime = o->f_buftime;
+  f->f_synctime = o->f_synctime;
+  f->f_needsync = o->f_needsync;
+  f->f_outq = o->f_outq;
+  f->f_msgs = o->f_msgs;
+  f->f_bytes = o->f_bytes;
+  f->f_errors = o->f_errors;
+  f->f_dropped = o->f_dropped;
+  memcpy (f->f_synchist, o->f_synchist, sizeof (f->f_synchist));
+
+  o->f_buf = NULL;
+  o->f_buflen = 0;
+  o->f_outq = NULL;
+  o->f_type = F_UNUSED;
+}
+
+/* INIT -- Initialize syslogd from configuration table.  Actions
+   whose target is unchanged keep their open files and connections,
+   see find_old_action().  The others are closed once the new
+   configuration is in place.  */
 void
 init (int signo MAYBE_UNUSED)
 {
@@ -2095,52 +5220,49 @@ init (int signo MAYBE_UNUSED)
 
   dbg_printf ("init\n");
 
-  /* Close all open log files.  */
+  /* Report rate limited senders while files are still open.  */
+  if (RateBurst)
+    ratelimit_sweep (1);
+  RateInterval = RateBurst = 0;
+
   Initialized = 0;
-  for (f = Files; f != NULL; f = next)
+  free_dispatch ();
+  for (f = Files; f != NULL; f = f->f_next)
     {
-      int j;
-
       /* Flush any pending output.  */
       if (f->f_prevcount)
 	fprintlog (f, LocalHostName, 0, (char *) NULL);
-
-      switch (f->f_type)
-	{
-	case F_FILE:
-	case F_TTY:
-	case F_CONSOLE:
-	case F_PIPE:
-	  free (f->f_un.f_fname);
-	  close (f->f_file);
-	  break;
-	case F_FORW:
-	case F_FORW_SUSP:
-	case F_FORW_UNKN:
-	  free (f->f_un.f_forw.f_hname);
-	  break;
-	case F_USERS:
-	  for (j = 0; j < f->f_un.f_user.f_nusers; ++j)
-	    free (f->f_un.f_user.f_unames[j]);
-	  free (f->f_un.f_user.f_unames);
-	  break;
-	}
-      free (f->f_progname);
-      free (f->f_prevhost);
-      next = f->f_next;
-      free (f);
     }
 
+  OldFiles = Files;
   Files = NULL;		/* Empty the table.  */
   nextp = &Files;
   facilities_seen = 0;
 
+  /* Names of remote hosts may have changed.  */
+  hostcache_flush ();
+
   rc = load_conffile (ConfFile, nextp);
 
   ret = load_confdir (ConfDir, nextp);
   if (!ret)
     rc = 0;		/* Some allocation errors were found.  */
 
+  /* Close the files and connections no longer in use.  */
+  for (f = OldFiles; f != NULL; f = next)
+    {
+      next = f->f_next;
+      free_filed (f);
+    }
+  OldFiles = NULL;
+
+  build_dispatch ();
+
+  if (OutputThreads)
+    for (f = Files; f; f = f->f_next)
+      if (f->f_type == F_FILE && f->f_outq == NULL)
+	outq_start (f);
+
   Initialized = 1;
 
   if (Debug)
@@ -2166,6 +5288,7 @@ init (int signo MAYBE_UNUSED)
 	    case F_FORW:
 	    case F_FORW_SUSP:
 	    case F_FORW_UNKN:
+	    case F_FORW_TCP:
 	      dbg_printf ("%s", f->f_un.f_forw.f_hname);
 	      break;
 
@@ -2193,13 +5316,175 @@ init (int signo MAYBE_UNUSED)
   dbg_printf ("syslogd: restarted\n");
 }
 
+/* Return the program selector NAME of length LEN, or NULL.  */
+static struct progsel *
+find_progsel (const char *name, int len)
+{
+  struct progsel *ps;
+
+  for (ps = progsel_tab[hash_bytes (name, len) % PROGSEL_HASH]; ps;
+       ps = ps->ps_next)
+    if (ps->ps_len == len && strncmp (ps->ps_name, name, len) == 0)
+      return ps;
+
+  return NULL;
+}
+
+/* Append F to the NULL terminated array *FV of length *N.  */
+static void
+add_dispatch (struct filed ***fv, size_t *n, struct filed *f)
+{
+  *fv = xrealloc (*fv, (*n + 2) * sizeof (**fv));
+  (*fv)[(*n)++] = f;
+  (*fv)[*n] = NULL;
+}
+
+/* Index the list Files by facility and priority, and by program
+   selector, so that logmsg() need only visit matching entries.  */
+static void
+build_dispatch (void)
+{
+  struct filed *f;
+  int fac, pri, index = 0;
+
+  for (f = Files; f; f = f->f_next)
+    {
+      f->f_index = index++;
+
+      if (f->f_type == F_FORW_TCP)
+	add_dispatch (&TcpForw, &nTcpForw, f);
+
+      if (f->f_progname)
+	{
+	  struct progsel *ps;
+	  size_t n;
+
+	  ps = find_progsel (f->f_progname, f->f_prognlen);
+	  if (ps == NULL)
+	    {
+	      unsigned h = hash_bytes (f->f_progname, f->f_prognlen)
+		% PROGSEL_HASH;
+
+	      ps = xcalloc (1, sizeof (*ps));
+	      ps->ps_name = f->f_progname;
+	      ps->ps_len = f->f_prognlen;
+	      ps->ps_next = progsel_tab[h];
+	      progsel_tab[h] = ps;
+	      if (ps->ps_len > progsel_maxlen)
+		progsel_maxlen = ps->ps_len;
+	    }
+	  for (n = 0; ps->ps_files && ps->ps_files[n]; n++)
+	    ;
+	  add_dispatch (&ps->ps_files, &n, f);
+	  continue;
+	}
+
+      for (fac = 0; fac <= LOG_NFACILITIES; fac++)
+	for (pri = 0; pri <= LOG_PRIMASK; pri++)
+	  if (f->f_pmask[fac] & LOG_MASK (pri))
+	    {
+	      size_t n;
+
+	      for (n = 0; f_dispatch[fac][pri] && f_dispatch[fac][pri][n]; n++)
+		;
+	      add_dispatch (&f_dispatch[fac][pri], &n, f);
+	    }
+    }
+}
+
+/* Release the tables made by build_dispatch().  */
+static void
+free_dispatch (void)
+{
+  int fac, pri;
+
+  for (fac = 0; fac <= LOG_NFACILITIES; fac++)
+    for (pri = 0; pri <= LOG_PRIMASK; pri++)
+      {
+	free (f_dispatch[fac][pri]);
+	f_dispatch[fac][pri] = NULL;
+      }
+
+  for (fac = 0; fac < PROGSEL_HASH; fac++)
+    while (progsel_tab[fac])
+      {
+	struct progsel *ps = progsel_tab[fac];
+
+	progsel_tab[fac] = ps->ps_next;
+	free (ps->ps_files);
+	free (ps);
+      }
+  progsel_maxlen = 0;
+
+  free (TcpForw);
+  TcpForw = NULL;
+  nTcpForw = 0;
+}
+
+/* Collect those files with a program selector matching MSG, which
+   accept facility FAC and priority PRILEV, into an allocated array
+   returned in *SEL, or NULL if there are none.  Return their number.
+   The result is in configuration order.  It is not kept in a static
+   buffer, since logmsg() may recurse by way of logerror().
+
+   The usual, and desirable, formattings are:
+
+     prg: message text
+     prg[PIDNO]: message text
+
+   A selector matches a prefix of the message, provided it is not
+   followed by an alphanumeric character, by `-', or by `_'.  */
+static size_t
+match_progsel (const char *msg, int fac, int prilev, struct filed ***sel)
+{
+  struct filed **hits = NULL;
+  size_t n = 0, max = 0;
+  int len;
+
+  for (len = 1; len <= progsel_maxlen && msg[len - 1]; len++)
+    {
+      struct progsel *ps;
+      struct filed **fv;
+
+      /* Avoid matching on prefixes.  */
+      if (isalnum (msg[len]) || msg[len] == '-' || msg[len] == '_')
+	continue;
+
+      ps = find_progsel (msg, len);
+      if (ps == NULL)
+	continue;
+
+      for (fv = ps->ps_files; *fv; fv++)
+	if ((*fv)->f_pmask[fac] & LOG_MASK (prilev))
+	  {
+	    size_t i;
+
+	    if (n == max)
+	      {
+		max = 2 * max + 4;
+		hits = xrealloc (hits, max * sizeof (*hits));
+	      }
+
+	    /* Insertion sort, as distinct selectors rarely match.  */
+	    for (i = n++; i > 0 && hits[i - 1]->f_index > (*fv)->f_index; i--)
+	      hits[i] = hits[i - 1];
+	    hits[i] = *fv;
+	  }
+    }
+
+  *sel = hits;
+  return n;
+}
+
 /* Crack a configuration file line.  */
 void
 cfline (const char *line, struct filed *f)
 {
   struct addrinfo hints, *rp;
+  struct filed *o;
   int i, pri, negate_pri, excl_pri, err;
   unsigned int pri_set, pri_clear;
+  size_t len;
   char *bp;
   const char *p, *q;
   char buf[MAXLINE], ebuf[200];
@@ -2335,6 +5620,21 @@ cfline (const char *line, struct filed *f)
       p++;
     }
 
+  /* Strip a suffix naming the output format.  */
+  f->f_format = action_format (p, &len);
+  if (p[len])
+    {
+      if (len >= sizeof (buf))
+	{
+	  f->f_type = F_UNUSED;
+	  logerror ("action field too long");
+	  return;
+	}
+      memcpy (buf, p, len);
+      buf[len] = '\0';
+      p = buf;
+    }
+
   if (!strlen(p))
     {
       /* Invalidate an entry with empty action field.  */
@@ -2346,7 +5646,61 @@ cfline (const char *line, struct filed *f)
   switch (*p)
     {
     case '@':
+      if (p[1] == '@')
+	{
+	  /* TCP forwarding: @@host, @@host:port, or @@[address]:port.  */
+	  char *host;
+	  const char *port = NULL;
+	  int bracket;
+
+	  p += 2;
+	  bracket = *p == '[' && strchr (p, ']');
+	  host = f->f_un.f_forw.f_hname = strdup (bracket ? p + 1 : p);
+	  if (host == NULL)
+	    {
+	      f->f_type = F_UNUSED;
+	      logerror ("cannot allocate memory");
+	      break;
+	    }
+	  if (bracket)
+	    {
+	      bp = strchr (host, ']');
+	      *bp = '\0';
+	      if (bp[1] == ':')
+		port = bp + 2;
+	    }
+	  else if ((bp = strchr (host, ':')) && !strchr (bp + 1, ':'))
+	    {
+	      *bp = '\0';
+	      port = bp + 1;
+	    }
+
+	  if (!port || !*port)
+	    port = TCPFORWPORT;
+	  o = find_old_action (F_FORW_TCP, host, port);
+	  if (o)
+	    take_over_action (f, o);
+	  else
+	    {
+	      f->f_un.f_forw.f_tcp = tcpforw_new (host, port);
+	      f->f_type = F_FORW_TCP;
+	    }
+	  break;
+	}
+
       f->f_un.f_forw.f_hname = strdup (++p);
+      if (f->f_un.f_forw.f_hname == NULL)
+	{
+	  f->f_type = F_UNUSED;
+	  logerror ("cannot allocate memory");
+	  break;
+	}
+      o = find_old_action (F_FORW, p, NULL);
+      if (o)
+	{
+	  take_over_action (f, o);
+	  break;
+	}
       memset (&hints, 0, sizeof (hints));
       hints.ai_family = usefamily;
       hints.ai_socktype = SOCK_DGRAM;
@@ -2392,6 +5746,12 @@ cfline (const char *line, struct filed *f)
       break;
 
     case '|':
+      o = find_old_action (F_FILE, p, NULL);
+      if (o)
+	{
+	  take_over_action (f, o);
+	  break;
+	}
       f->f_un.f_fname = strdup (p);
       f->f_file = open (++p, O_RDWR | O_NONBLOCK);
       if (f->f_file < 0)
@@ -2411,6 +5771,12 @@ cfline (const char *line, struct filed *f)
       break;
 
     case '/':
+      o = find_old_action (F_FILE, p, NULL);
+      if (o)
+	{
+	  take_over_action (f, o);
+	  break;
+	}
       f->f_un.f_fname = strdup (p);
       f->f_file = open (p, O_WRONLY | O_APPEND | O_CREAT, 0644);
       if (f->f_file < 0)
@@ -2492,6 +5858,11 @@ dbg_toggle (int signo MAYBE_UNUSED)
   dbg_output = 1;
   dbg_printf ("Switching dbg_output to %s.\n",
 	      dbg_save == 0 ? "true" : "false");
+  dbg_printf ("Received %lu datagrams in %lu wakeups, at most %d at once.\n",
+	      RecvDatagrams, RecvWakeups, RecvMaxBatch);
+  outq_stats ();
+  dbg_printf ("Rate limiting dropped %lu messages, %zu senders tracked.\n",
+	      RateDropped, ratesrc_count);
   dbg_output = (dbg_save == 0) ? 1 : 0;
 
 #ifndef HAVE_SIGACTION
@@ -2529,6 +5900,35 @@ trigger_restart (int signo MAYBE_UNUSED)
 #endif
 }
 
+/* Likewise, SIGUSR2 asks the main loop to write statistics.  */
+void
+trigger_stats (int signo MAYBE_UNUSED)
+{
+  dump_stats = 1;
+#ifndef HAVE_SIGACTION
+  signal (SIGUSR2, trigger_stats);
+#endif
+}
+
+/* Likewise, SIGALRM asks the main loop to run domark(), which
+   writes to the files.  */
+void
+trigger_mark (int signo MAYBE_UNUSED)
+{
+  mark_due = 1;
+#ifndef HAVE_SIGACTION
+  signal (SIGALRM, trigger_mark);
+#endif
+}
+
+/* Termination signals ask the main loop to shut down, since die
+   takes the locks of output queues the interrupted code may hold.  */
+void
+trigger_die (int signo)
+{
+  terminate = signo;
+}
+
 /* Override default port with a non-NULL argument.
  * Otherwise identify the default syslog/udp with
  * proper fallback to avoid resolve issues.  */
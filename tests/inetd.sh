@@ -151,13 +151,14 @@ clean_testdir () {
 # Write a fresh configuration file.  Port is input parameter.
 write_conf () {
     # First argument is port number.  Node is fixed.
+    # An optional second argument adds service options.
     : > $CONF
 
     test "$TEST_IPV4" = "no" ||
-	echo "$TARGET:$1 stream tcp4 nowait $USER $ADDRPEEK addrpeek addr" \
+	echo "$TARGET:$1 stream tcp4 nowait$2 $USER $ADDRPEEK addrpeek addr" \
 	    >> $CONF
     test "$TEST_IPV6" = "no" ||
-	echo "$TARGET6:$1 stream tcp6 nowait $USER $ADDRPEEK addrpeek addr" \
+	echo "$TARGET6:$1 stream tcp6 nowait$2 $USER $ADDRPEEK addrpeek addr" \
 	    >> $CONF
 }
 
@@ -217,6 +218,53 @@ else
     $silence echo "Passed `expr $nn - 1` SIGHUP rounds."
 fi
 
+# The stream builtin chargen, served by inetd itself where possible.
+# Its standard port needs a superuser.
+if test $errno -eq 0 && test `func_id_uid` = 0 &&
+    test "$TEST_IPV4" != "no" && test -n "$TARGET"; then
+    echo "$TARGET:chargen stream tcp4 nowait $USER internal" >> $CONF
+    kill -HUP `cat $PID`
+    sleep 1
+
+    # The server never closes, so the client ends on its timeout.
+    ($TCPGET -t 1 $TARGET 19; :) 2>/dev/null |
+	$FGREP '0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ' >/dev/null 2>&1 \
+    || { errno=`expr $errno + 1`;
+	 echo >&2 "*** The builtin chargen did not answer. ***"; }
+fi
+
+# Service options: two sockets sharing the port, and TCP Fast Open.
+# Several connections are made, so that both sockets are likely used.
+if test $errno -eq 0; then
+    PORT=`expr $PORT + 1 + ${RANDOM:-$$} % 521`
+    write_conf $PORT ,listeners=2,fastopen=16
+    kill -HUP `cat $PID`
+    sleep 1
+
+    for nn in 1 2 3 4; do
+	if test "$TEST_IPV4" != "no" && test -n "$TARGET"; then
+	    $TCPGET $TARGET $PORT 2>/dev/null |
+		$GREP "Your address is $TARGET." >/dev/null 2>&1 \
+	    || errno=`expr $errno + 1`
+	fi # TEST_IPV4 && TARGET
+
+	if test "$TEST_IPV6" != "no" && test -n "$TARGET6"; then
+	    $TCPGET $TARGET6 $PORT 2>/dev/null |
+		$GREP "Your address is $TARGET6." >/dev/null 2>&1 \
+	    || errno=`expr $errno + 1`
+	fi # TEST_IPV6 && TARGET6
+    done
+
+    test $errno -eq 0 ||
+	cat >&2 <<-EOT
+	*** Test of service options has failed $errno times. ***
+	Configuration file:
+	##### $CONF
+	`cat $CONF`
+	###########
+	EOT
+fi
+
 test $errno -ne 0 || $silence echo 'Successful testing.'
 
 clean_testdir
@@ -0,0 +1,430 @@
+/* syslogbench - measure throughput and latency of syslogd.
+  Copyright (C) 2022 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/* Syslogbench sends a stream of numbered messages to a running
+ * syslogd, over its unix socket, over UDP, or alternating between
+ * both, and follows a log file which receives every message.  Each
+ * message carries the time it was sent, so that the delay until it
+ * appears in the file can be measured.  Facilities and sizes of the
+ * messages vary, and a share of them can be sent up to four times in
+ * a row, to exercise the suppression of repeated messages.
+ *
+ * Invocation:
+ *
+ *   syslogbench [-u socket] [-i [host:]port] [-n count] [-r rate]
+ *               [-s min[,max]] [-d percent] [-w secs] [-m rate] -o file
+ *
+ * The count defaults to 10000 messages, sent as fast as possible.
+ * Sizes default to between 64 and 512 bytes.  After the last message
+ * the file is followed for at most five seconds, or the time given
+ * with `-w', until every message has arrived.  A suitable line in
+ * `syslog.conf' is
+ *
+ *   *.*	-/tmp/bench.log
+ *
+ * The program reports messages sent and delivered per second, lost
+ * messages, and percentiles of the delay.  It fails if a message was
+ * lost, or if fewer messages than given with `-m' were delivered per
+ * second, which makes it usable in scripts catching regressions.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <progname.h>
+
+#define MAXSIZE	1024	/* Largest message sent.  */
+
+static const int facilities[] = {
+  LOG_USER, LOG_DAEMON, LOG_AUTH, LOG_MAIL, LOG_LOCAL0, LOG_LOCAL3,
+  LOG_LOCAL7
+};
+
+static char marker[32];		/* Identifies messages of this run.  */
+static size_t markerlen;
+
+static char *seen;		/* Messages found in the file.  */
+static unsigned long *delays;	/* Their delays, in microseconds.  */
+static unsigned long count = 10000, ndelays, again, repeated;
+static struct timespec start;
+
+static void
+usage (void)
+{
+  fprintf (stderr, "Usage: %s [-u socket] [-i [host:]port] [-n count]"
+	   " [-r rate]\n\t[-s min[,max]] [-d percent] [-w secs]"
+	   " [-m rate] -o file\n", program_name);
+  exit (EXIT_FAILURE);
+}
+
+/* Microseconds since the start of the run.  */
+static unsigned long long
+elapsed (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - start.tv_sec) * 1000000ULL
+    + (ts.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/* Account for a line of the log file.  */
+static void
+scan_line (const char *line, unsigned long long now)
+{
+  const char *p;
+  unsigned long id;
+  unsigned long long sent;
+
+  p = strstr (line, marker);
+  if (p && sscanf (p + markerlen, "%lu.%llu", &id, &sent) == 2)
+    {
+      if (id >= count)
+	return;
+      if (seen[id])
+	again++;
+      else
+	{
+	  seen[id] = 1;
+	  delays[ndelays++] = now > sent ? now - sent : 0;
+	}
+      return;
+    }
+
+  p = strstr (line, "last message repeated ");
+  if (p)
+    repeated += strtoul (p + 22, NULL, 10);
+}
+
+/* Read what has been appended to the file FD, and account for
+   every complete line.  */
+static void
+follow (int fd)
+{
+  static char buf[65536];
+  static size_t len;
+  unsigned long long now;
+  ssize_t n;
+
+  while ((n = read (fd, buf + len, sizeof (buf) - len - 1)) > 0)
+    {
+      char *p, *nl;
+
+      now = elapsed ();
+      len += n;
+      buf[len] = '\0';
+      for (p = buf; (nl = strchr (p, '\n')); p = nl + 1)
+	{
+	  *nl = '\0';
+	  scan_line (p, now);
+	}
+      len -= p - buf;
+      memmove (buf, p, len);
+
+      /* An overlong line is of no interest.  */
+      if (len == sizeof (buf) - 1)
+	len = 0;
+    }
+}
+
+static int
+cmp_ulong (const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *) a;
+  unsigned long y = *(const unsigned long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* The delay not exceeded by P per mille of the messages.  */
+static unsigned long
+percentile (int p)
+{
+  size_t i = (ndelays * p + 999) / 1000;
+
+  return delays[i ? i - 1 : 0];
+}
+
+static int
+open_inet (const char *spec)
+{
+  struct addrinfo hints, *ai, *res;
+  const char *host = "localhost";
+  char *copy, *port;
+  int fd = -1, rc;
+
+  copy = port = strdup (spec);
+  if (copy && (port = strrchr (copy, ':')))
+    {
+      *port++ = '\0';
+      host = copy;
+    }
+  else
+    port = copy;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  rc = getaddrinfo (host, port, &hints, &res);
+  if (rc)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_name, spec,
+	       gai_strerror (rc));
+      exit (EXIT_FAILURE);
+    }
+
+  for (ai = res; ai; ai = ai->ai_next)
+    {
+      fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+	continue;
+      if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	break;
+      close (fd);
+      fd = -1;
+    }
+  freeaddrinfo (res);
+  free (copy);
+
+  if (fd < 0)
+    {
+      perror (spec);
+      exit (EXIT_FAILURE);
+    }
+  return fd;
+}
+
+static int
+open_unix (const char *path)
+{
+  struct sockaddr_un sun;
+  int fd;
+
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strncpy (sun.sun_path, path, sizeof (sun.sun_path) - 1);
+
+  fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+    {
+      perror (path);
+      exit (EXIT_FAILURE);
+    }
+  return fd;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int opt, fd, ufd = -1, ifd = -1;
+  unsigned long rate = 0, minrate = 0, dups = 0, sent = 0, dupsent = 0;
+  unsigned long nunix = 0, ninet = 0, id, lost;
+  unsigned long long sendtime, lasttime, waittime = 5000000;
+  size_t minsize = 64, maxsize = 512;
+  unsigned seed = 1;
+  char *file = NULL, *p;
+  char msg[MAXSIZE + 1];
+  size_t msglen = 0;
+  double secs;
+
+  set_program_name (argv[0]);
+
+  while ((opt = getopt (argc, argv, "d:i:m:n:o:r:s:u:w:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'd':
+	  dups = strtoul (optarg, NULL, 10);
+	  if (dups > 100)
+	    usage ();
+	  break;
+
+	case 'i':
+	  ifd = open_inet (optarg);
+	  break;
+
+	case 'm':
+	  minrate = strtoul (optarg, NULL, 10);
+	  break;
+
+	case 'n':
+	  count = strtoul (optarg, NULL, 10);
+	  break;
+
+	case 'o':
+	  file = optarg;
+	  break;
+
+	case 'r':
+	  rate = strtoul (optarg, NULL, 10);
+	  break;
+
+	case 's':
+	  minsize = maxsize = strtoul (optarg, &p, 10);
+	  if (*p == ',')
+	    maxsize = strtoul (p + 1, NULL, 10);
+	  break;
+
+	case 'u':
+	  ufd = open_unix (optarg);
+	  break;
+
+	case 'w':
+	  waittime = strtoul (optarg, NULL, 10) * 1000000ULL;
+	  break;
+
+	default:
+	  usage ();
+	}
+    }
+
+  if (file == NULL || optind < argc || count == 0
+      || (ufd < 0 && ifd < 0))
+    usage ();
+  if (maxsize > MAXSIZE)
+    maxsize = MAXSIZE;
+  if (minsize > maxsize)
+    minsize = maxsize;
+
+  fd = open (file, O_RDONLY | O_CREAT, 0644);
+  if (fd < 0)
+    {
+      perror (file);
+      return EXIT_FAILURE;
+    }
+  lseek (fd, 0, SEEK_END);
+
+  seen = calloc (count, 1);
+  delays = calloc (count, sizeof (*delays));
+  if (seen == NULL || delays == NULL)
+    {
+      perror (program_name);
+      return EXIT_FAILURE;
+    }
+
+  snprintf (marker, sizeof (marker), " bench%lu:", (unsigned long) getpid ());
+  markerlen = strlen (marker);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  for (id = 0; id < count; id++)
+    {
+      int s = (ufd >= 0 && (ifd < 0 || id % 2 == 0)) ? ufd : ifd;
+      int copies;
+      size_t size;
+
+      /* Keep to the requested rate.  */
+      if (rate)
+	while ((sendtime = elapsed ()) < id * 1000000ULL / rate)
+	  {
+	    struct timespec ts = { 0, 100000 };
+
+	    follow (fd);
+	    nanosleep (&ts, NULL);
+	  }
+      else if (id % 64 == 0)
+	follow (fd);
+
+      seed = seed * 1103515245 + 12345;
+      size = minsize + (seed >> 8) % (maxsize - minsize + 1);
+      copies = (seed >> 4) % 100 < dups ? 2 + (seed >> 12) % 3 : 1;
+
+      msglen = snprintf (msg, sizeof (msg), "<%d>syslogbench:%s%lu.%llu ",
+			 facilities[id % (sizeof (facilities)
+					  / sizeof (*facilities))]
+			 | LOG_INFO, marker, id, elapsed ());
+      if (msglen < size)
+	{
+	  memset (msg + msglen, 'x', size - msglen);
+	  msglen = size;
+	}
+
+      do
+	{
+	  while (send (s, msg, msglen, 0) < 0)
+	    {
+	      if (errno == EINTR || errno == ENOBUFS || errno == EAGAIN)
+		continue;
+	      perror ("send");
+	      return EXIT_FAILURE;
+	    }
+	  sent++;
+	  if (s == ufd)
+	    nunix++;
+	  else
+	    ninet++;
+	}
+      while (--copies && ++dupsent);
+    }
+  sendtime = elapsed ();
+
+  /* Wait for stragglers.  */
+  lasttime = sendtime;
+  while (ndelays < count && elapsed () < lasttime + waittime)
+    {
+      unsigned long before = ndelays;
+      struct timespec ts = { 0, 1000000 };
+
+      follow (fd);
+      if (ndelays > before)
+	lasttime = elapsed ();
+      else
+	nanosleep (&ts, NULL);
+    }
+  follow (fd);
+
+  lost = count - ndelays;
+  secs = sendtime / 1e6;
+  printf ("sent: %lu messages (%lu unix, %lu inet, %lu repeated)"
+	  " in %.3f s, %.0f/s\n", sent, nunix, ninet, dupsent,
+	  secs, secs > 0 ? sent / secs : 0.0);
+
+  secs = lasttime / 1e6;
+  printf ("delivered: %lu messages, %.0f/s, %lu lost (%.2f%%)\n", ndelays,
+	  secs > 0 ? ndelays / secs : 0.0, lost, 100.0 * lost / count);
+  if (dupsent)
+    printf ("repeated: %lu written again, %lu reported as repeated\n",
+	    again, repeated);
+
+  if (ndelays)
+    {
+      qsort (delays, ndelays, sizeof (*delays), cmp_ulong);
+      printf ("latency: min %lu, 50%% %lu, 90%% %lu, 99%% %lu,"
+	      " 99.9%% %lu, max %lu us\n", delays[0], percentile (500),
+	      percentile (900), percentile (990), percentile (999),
+	      delays[ndelays - 1]);
+    }
+
+  if (lost || (minrate && (secs <= 0 || ndelays / secs < minrate)))
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
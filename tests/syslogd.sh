@@ -482,17 +482,25 @@ OUT_UNOTICE="$IU_TESTDIR"/usernotice.log
 OUT_USER="$IU_TESTDIR"/user.log
 OUT_DEBUG="$IU_TESTDIR"/debug.log
 OUT_LOCAL0="$IU_TESTDIR"/local0.log
+OUT_RFC5424="$IU_TESTDIR"/rfc5424.log
+OUT_JSON="$IU_TESTDIR"/json.log
 
 # Create the new files to avoid false negatives.
 : > "$OUT_UNOTICE"
 : > "$OUT_USER"
 : > "$OUT_DEBUG"
 : > "$OUT_LOCAL0"
+: > "$OUT_RFC5424"
+: > "$OUT_JSON"
 
+# The user.info messages are also written in the output formats
+# RFC5424 and JSON.
 cat > "$CONF" <<-EOT
 	*.*		$OUT
 	user.=info	$OUT_USER
 	user.=notice	$OUT_UNOTICE
+	user.=info	$OUT_RFC5424;RFC5424
+	user.=info	$OUT_JSON;json
 EOT
 
 cat > "$CONFD/debug" <<-EOT
@@ -573,6 +581,29 @@ if $do_inet_socket; then
     fi # TEST_IPV6 && TARGET6
 fi # do_inet_socket
 
+# Rate limiting, allowing three messages a minute for each program.
+#
+OUT_RATE="$IU_TESTDIR"/rate.log
+TAG3="syslogd-rate-test"
+
+if $do_unix_socket; then
+    # Let the messages above arrive before the reload.
+    sleep 1
+    : > "$OUT_RATE"
+    cat > "$CONF" <<-EOT
+	ratelimit 60 3
+	*.*	$OUT_RATE
+	EOT
+    kill -HUP `cat "$PID"`
+    sleep 2
+
+    TESTCASES=`expr $TESTCASES + 1`
+    for nn in 1 2 3 4 5; do
+	$LOGGER -h "$SOCKET" -p user.info -t "$TAG3" \
+	    "Rate limited message $nn. (pid $$)"
+    done
+fi # do_unix_socket
+
 # Remove previous SYSLOG daemon.
 test -r "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1 &&
     kill "`cat "$PID"`"
@@ -653,6 +684,27 @@ COUNT5_user=`$GREP -c "$TAG2.*user" "$OUT_LOCAL0"`
 COUNT5_local=`cat "$OUT_USER" "$OUT_UNOTICE" "$OUT_DEBUG" | \
 	      $GREP -c "$TAG2.*local0"`
 
+# The messages of $OUT_USER should be found in the output formats,
+# with a time stamp of RFC 3339.
+STAMP='[0-9]\{4\}-[0-9][0-9]-[0-9][0-9]T[0-9:.]*[-+Z][0-9:]*'
+COUNT6=`$GREP -c "^<14>1 $STAMP [^ ]* $TAG2 - - - user.info" \
+	"$OUT_RFC5424"`
+COUNT7=`$GREP -c "^{\"time\":\"$STAMP\",.*\"severity\":\"info\",\
+\"tag\":\"$TAG2\",\"msg\":\"user.info" "$OUT_JSON"`
+if test $COUNT2 -gt 0; then
+    TESTCASES=`expr $TESTCASES + 2`
+    test $COUNT6 -eq $COUNT2 && SUCCESSES=`expr $SUCCESSES + 1`
+    test $COUNT7 -eq $COUNT2 && SUCCESSES=`expr $SUCCESSES + 1`
+fi
+
+# Only the first three messages of $TAG3 pass the rate limit.
+if $do_unix_socket; then
+    COUNT8=`$GREP -c "$TAG3: Rate limited message [123]\." "$OUT_RATE"`
+    COUNT8_all=`$GREP -c "$TAG3: Rate limited message" "$OUT_RATE"`
+    test $COUNT8 -eq 3 && test $COUNT8_all -eq 3 &&
+	SUCCESSES=`expr $SUCCESSES + 1`
+fi
+
 SUCCESSES=`expr $SUCCESSES + $COUNT + $COUNT_WRAP \
 		+ 2 \* $COUNT2 - $COUNT2_debug \
 		+ 2 \* $COUNT3 - $COUNT3_info \
@@ -677,6 +729,12 @@ if [ -n "${VERBOSE+yes}" ]; then
 	`cat "$OUT_DEBUG"`
 	---------- Local0 message log. ----------------------
 	`cat "$OUT_LOCAL0"`
+	---------- RFC5424 message log. ---------------------
+	`cat "$OUT_RFC5424"`
+	---------- JSON message log. ------------------------
+	`cat "$OUT_JSON"`
+	---------- Rate limited message log. ----------------
+	`cat "$OUT_RATE"`
 	-----------------------------------------------------
 	EOT
 fi